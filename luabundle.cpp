@@ -0,0 +1,143 @@
+/*******************************************************************************
+  url/git: http://fpaboim.github.com/luawrapper
+  Distributed under the MIT License.
+
+  Packs the lua files of a directory tree into a LuaBundle. Module names
+  follow require: "net/http.lua" becomes "net.http" and "net/init.lua"
+  becomes "net". Every file is compiled to check its syntax; with --compile
+  the bundle stores the bytecode (stripped of debug information with
+  --strip, lua 5.3 and later) instead of the source. POSIX only.
+
+  Build against lua, e.g.:
+    g++ -O2 -std=c++11 luabundle.cpp -llua -o luabundle
+  Usage:
+    luabundle [--compile] [--strip] <directory> <output>
+*******************************************************************************/
+#include <dirent.h>
+#include <string>
+#include <vector>
+#include "luawrapper.hpp"
+
+LuaWrapper* LuaWrapper::m_LuaWrapper = NULL;
+
+// the packer does not need the application commands
+int luaopen_commands(lua_State*) { return 0; }
+
+// readFile: reads the whole file into data
+////////////////////////////////////////////////////////////////////////////////
+static bool readFile(const std::string& filename, std::string& data) {
+  FILE* fp = fopen(filename.c_str(), "rb");
+  if (!fp)
+    return false;
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    data.append(buf, n);
+  bool ok = !ferror(fp);
+  fclose(fp);
+  return ok;
+}
+
+// moduleName: require name of a path relative to the bundled directory
+////////////////////////////////////////////////////////////////////////////////
+static std::string moduleName(std::string path) {
+  path.erase(path.size() - 4); // ".lua"
+  for (size_t i = 0; i < path.size(); i++) {
+    if (path[i] == '/')
+      path[i] = '.';
+  }
+  if (path.size() > 5 && path.compare(path.size() - 5, 5, ".init") == 0)
+    path.erase(path.size() - 5);
+  return path;
+}
+
+// collect: adds the lua files below dir/rel to files, skipping hidden entries
+////////////////////////////////////////////////////////////////////////////////
+static bool collect(const std::string& dir, const std::string& rel,
+                    std::vector<std::string>& files) {
+  std::string path = rel.empty() ? dir : dir + "/" + rel;
+  DIR* d = opendir(path.c_str());
+  if (!d) {
+    fprintf(stderr, "cannot open directory %s\n", path.c_str());
+    return false;
+  }
+  bool ok = true;
+  while (struct dirent* entry = readdir(d)) {
+    if (entry->d_name[0] == '.')
+      continue;
+    std::string name = rel.empty() ? entry->d_name
+                                   : rel + "/" + entry->d_name;
+    struct stat st;
+    if (stat((dir + "/" + name).c_str(), &st) != 0)
+      continue;
+    if (S_ISDIR(st.st_mode)) {
+      ok = collect(dir, name, files) && ok;
+    } else if (S_ISREG(st.st_mode) && name.size() > 4 &&
+               name.compare(name.size() - 4, 4, ".lua") == 0) {
+      files.push_back(name);
+    }
+  }
+  closedir(d);
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  bool compile = false;
+  bool strip   = false;
+  std::vector<const char*> paths;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--compile"))
+      compile = true;
+    else if (!strcmp(argv[i], "--strip"))
+      strip = true;
+    else
+      paths.push_back(argv[i]);
+  }
+  if (paths.size() != 2) {
+    fprintf(stderr, "usage: %s [--compile] [--strip] <directory> <output>\n",
+            argv[0]);
+    return 2;
+  }
+
+  std::vector<std::string> files;
+  if (!collect(paths[0], "", files))
+    return 1;
+
+  LuaWrapper lw;
+  lua_State* L = lw.getLuaState();
+  std::vector<LuaBundle::Module> modules;
+  int errors = 0;
+  for (size_t i = 0; i < files.size(); i++) {
+    LuaBundle::Module m;
+    m.name = moduleName(files[i]);
+    if (!readFile(std::string(paths[0]) + "/" + files[i], m.data)) {
+      fprintf(stderr, "cannot read %s\n", files[i].c_str());
+      errors++;
+      continue;
+    }
+    std::string chunkname = "@" + m.name;
+    if (lw.loadBuffer(m.data.data(), m.data.size(), chunkname.c_str(),
+                      false) != 0) {
+      fprintf(stderr, "%s\n", lw.lastError().message().str().c_str());
+      errors++;
+      continue;
+    }
+    if (compile) {
+      std::string bytecode;
+      lua_dump(L, luawrapper_detail::dumpWriter, &bytecode, strip ? 1 : 0);
+      m.data.swap(bytecode);
+    }
+    lua_pop(L, 1);
+    modules.push_back(m);
+  }
+  if (errors)
+    return 1;
+
+  size_t count = modules.size();
+  if (!LuaBundle::write(paths[1], modules)) {
+    fprintf(stderr, "cannot write %s (duplicate module names?)\n", paths[1]);
+    return 1;
+  }
+  printf("%s: %zu modules\n", paths[1], count);
+  return 0;
+}
@@ -10,334 +10,3571 @@
   from the lua global namespace and then push the arguments to the function. To
   call the function use "callFunction(number_of_arguments, number_of_retvalues".
   Return values should then be popped from stack.
+
+  Besides the singleton, independent wrappers may be constructed directly and
+  LuaStatePool hands out fully initialized states to worker threads. Requires
+  C++11 and lua 5.3 or later.
 *******************************************************************************/
 #ifndef LUAWRAPPER_HPP
 #define LUAWRAPPER_HPP
 
-// includes
-#include <string.h>
-#include <stdlib.h>
-#include <stdio.h>
-#include "lua.hpp"
+// includes
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+#include "lua.hpp"
+
+#if LUA_VERSION_NUM < 503
+#error "luawrapper requires lua 5.3 or later"
+#endif
+
+// macro to call the singleton LuaWrapper
+#define luaWrap LuaWrapper::instance()
+
+extern int luaopen_commands (lua_State* tolua_S);
+
+class LuaFunction;
+
+////////////////////////////////////////////////////////////////////////////////
+// LuaStack: compile time push/read of C++ values, specialize to add types.
+// check raises a lua argument error if the value at index cannot be read as
+// T, bound functions check every argument before converting any of them.
+////////////////////////////////////////////////////////////////////////////////
+
+template <class T, class Enable = void>
+struct LuaStack;
+
+template <>
+struct LuaStack<bool> {
+  static void push(lua_State* L, bool b) { lua_pushboolean(L, b); }
+  static bool to(lua_State* L, int index) {
+    return lua_toboolean(L, index) != 0;
+  }
+  static void check(lua_State* L, int index) { luaL_checkany(L, index); }
+};
+
+template <class T>
+struct LuaStack<T, typename std::enable_if<std::is_integral<T>::value &&
+                                         !std::is_same<T, bool>::value>::type> {
+  static void push(lua_State* L, T n) { lua_pushinteger(L, (lua_Integer)n); }
+  static T to(lua_State* L, int index) { return (T)lua_tointeger(L, index); }
+  static void check(lua_State* L, int index) { luaL_checkinteger(L, index); }
+};
+
+template <class T>
+struct LuaStack<T, typename std::enable_if<
+                     std::is_floating_point<T>::value>::type> {
+  static void push(lua_State* L, T n) { lua_pushnumber(L, (lua_Number)n); }
+  static T to(lua_State* L, int index) { return (T)lua_tonumber(L, index); }
+  static void check(lua_State* L, int index) { luaL_checknumber(L, index); }
+};
+
+// Warning: as with popString the pointer is only valid while the value is
+// referenced by lua, prefer std::string for values that outlive the stack slot
+template <>
+struct LuaStack<const char*> {
+  static void push(lua_State* L, const char* s) { lua_pushstring(L, s); }
+  static const char* to(lua_State* L, int index) {
+    return lua_tostring(L, index);
+  }
+  static void check(lua_State* L, int index) { luaL_checkstring(L, index); }
+};
+
+template <>
+struct LuaStack<char*> {
+  static void push(lua_State* L, const char* s) { lua_pushstring(L, s); }
+};
+
+template <>
+struct LuaStack<std::string> {
+  static void push(lua_State* L, const std::string& s) {
+    lua_pushlstring(L, s.data(), s.size());
+  }
+  static std::string to(lua_State* L, int index) {
+    size_t len = 0;
+    const char* s = lua_tolstring(L, index, &len);
+    return s ? std::string(s, len) : std::string();
+  }
+  static void check(lua_State* L, int index) { luaL_checkstring(L, index); }
+};
+
+template <>
+struct LuaStack<void*> {
+  static void push(lua_State* L, void* p) { lua_pushlightuserdata(L, p); }
+  static void* to(lua_State* L, int index) { return lua_touserdata(L, index); }
+  static void check(lua_State* L, int index) {
+    if (!lua_isuserdata(L, index))
+      luaL_argerror(L, index, "userdata expected");
+  }
+};
+
+namespace luawrapper_detail {
+
+// compile time index lists used to expand tuples into stack indices
+template <int... I> struct Indices {};
+template <int N, int... I>
+struct MakeIndices : MakeIndices<N - 1, N - 1, I...> {};
+template <int... I>
+struct MakeIndices<0, I...> { typedef Indices<I...> type; };
+
+// Results: number of lua results for a C++ return type and how to read them
+// from the top of the stack
+template <class R>
+struct Results {
+  static const int count = 1;
+  static R get(lua_State* L) { return LuaStack<R>::to(L, -1); }
+};
+
+template <>
+struct Results<void> {
+  static const int count = 0;
+  static void get(lua_State*) {}
+};
+
+template <class... Ts>
+struct Results< std::tuple<Ts...> > {
+  static const int count = sizeof...(Ts);
+  static std::tuple<Ts...> get(lua_State* L) {
+    return get(L, typename MakeIndices<sizeof...(Ts)>::type());
+  }
+  template <int... I>
+  static std::tuple<Ts...> get(lua_State* L, Indices<I...>) {
+    return std::tuple<Ts...>(LuaStack<Ts>::to(L, I - count)...);
+  }
+};
+
+// pushAll: pushes every argument in order, expands to one push per argument
+inline void pushAll(lua_State*) {}
+
+template <class A, class... Args>
+inline void pushAll(lua_State* L, A&& a, Args&&... args) {
+  LuaStack<typename std::decay<A>::type>::push(L, std::forward<A>(a));
+  pushAll(L, std::forward<Args>(args)...);
+}
+
+// newUserdata: full userdata without user values where the version allows it
+inline void* newUserdata(lua_State* L, size_t size) {
+#if LUA_VERSION_NUM >= 504
+  return lua_newuserdatauv(L, size, 0);
+#else
+  return lua_newuserdata(L, size);
+#endif
+}
+
+// ReturnPusher: calls a C++ callable and pushes its result, a std::tuple is
+// pushed as multiple results. Returns the number of results.
+template <class R>
+struct ReturnPusher {
+  template <class F, class... A>
+  static int call(lua_State* L, F& f, A&&... a) {
+    LuaStack<typename std::decay<R>::type>::push(L, f(std::forward<A>(a)...));
+    return 1;
+  }
+};
+
+template <>
+struct ReturnPusher<void> {
+  template <class F, class... A>
+  static int call(lua_State*, F& f, A&&... a) {
+    f(std::forward<A>(a)...);
+    return 0;
+  }
+};
+
+template <class... Ts>
+struct ReturnPusher< std::tuple<Ts...> > {
+  template <class F, class... A>
+  static int call(lua_State* L, F& f, A&&... a) {
+    push(L, f(std::forward<A>(a)...),
+         typename MakeIndices<sizeof...(Ts)>::type());
+    return (int)sizeof...(Ts);
+  }
+  template <int... I>
+  static void push(lua_State* L, const std::tuple<Ts...>& t, Indices<I...>) {
+    pushAll(L, std::get<I>(t)...);
+  }
+};
+
+// checkArgs: raises an argument error for the first of stack indices 1..n
+// that cannot be read as its Args type. Runs before any argument is
+// converted, so no C++ temporary is live when the error longjmps.
+template <class... Args, int... I>
+inline void checkArgs(lua_State* L, Indices<I...>) {
+  int checked[] = {
+    0, (LuaStack<typename std::decay<Args>::type>::check(L, I + 1), 0)... };
+  (void)checked;
+  (void)L;
+}
+
+// invoke: checks and reads Args from stack indices 1..n, calls f with them
+// and pushes its results
+template <class R, class... Args, class F, int... I>
+inline int invoke(lua_State* L, F& f, Indices<I...> indices) {
+  checkArgs<Args...>(L, indices);
+  return ReturnPusher<R>::call(
+    L, f, LuaStack<typename std::decay<Args>::type>::to(L, I + 1)...);
+}
+
+template <class R, class... Args, class F>
+inline int invoke(lua_State* L, F& f) {
+  return invoke<R, Args...>(L, f,
+                            typename MakeIndices<sizeof...(Args)>::type());
+}
+
+// functionTrampoline: lua_CFunction calling the R(Args...) function pointer
+// stored in its first upvalue
+template <class R, class... Args>
+inline int functionTrampoline(lua_State* L) {
+  typedef R (*Function)(Args...);
+  Function f;
+  memcpy(&f, lua_touserdata(L, lua_upvalueindex(1)), sizeof(Function));
+  return invoke<R, Args...>(L, f);
+}
+
+// CallSignature: argument and result types of a callable's operator()
+template <class M>
+struct CallSignature;
+
+template <class C, class R, class... A>
+struct CallSignature<R (C::*)(A...)> {
+  // lua_CFunction calling the callable F stored in its first upvalue
+  template <class F>
+  static int trampoline(lua_State* L) {
+    F* f = (F*)lua_touserdata(L, lua_upvalueindex(1));
+    return invoke<R, A...>(L, *f);
+  }
+};
+
+template <class C, class R, class... A>
+struct CallSignature<R (C::*)(A...) const> : CallSignature<R (C::*)(A...)> {};
+
+// BoundMethod: object pointer plus member function pointer, trivially
+// copyable so it is stored inline in the closure upvalue
+template <class T, class M>
+struct BoundMethod;
+
+template <class T, class C, class R, class... A>
+struct BoundMethod<T, R (C::*)(A...)> {
+  T* obj;
+  R (C::*method)(A...);
+  R operator()(A... a) const { return (obj->*method)(std::forward<A>(a)...); }
+};
+
+template <class T, class C, class R, class... A>
+struct BoundMethod<T, R (C::*)(A...) const> {
+  const T* obj;
+  R (C::*method)(A...) const;
+  R operator()(A... a) const { return (obj->*method)(std::forward<A>(a)...); }
+};
+
+// CallableGc: metatable running the destructor of callables that need one
+template <class F>
+struct CallableGc {
+  static char tag;
+  static int gc(lua_State* L) {
+    ((F*)lua_touserdata(L, 1))->~F();
+    return 0;
+  }
+};
+template <class F>
+char CallableGc<F>::tag;
+
+// pushClosure: pushes a C closure whose single upvalue is a full userdata
+// holding the callable itself, no heap allocation besides the userdata
+template <class F>
+inline void pushClosure(lua_State* L, F&& f) {
+  typedef typename std::decay<F>::type Callable;
+  void* mem = newUserdata(L, sizeof(Callable));
+  new (mem) Callable(std::forward<F>(f));
+  if (!std::is_trivially_destructible<Callable>::value) {
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &CallableGc<Callable>::tag) ==
+        LUA_TNIL) {
+      lua_pop(L, 1);
+      lua_createtable(L, 0, 1);
+      lua_pushcfunction(L, &CallableGc<Callable>::gc);
+      lua_setfield(L, -2, "__gc");
+      lua_pushvalue(L, -1);
+      lua_rawsetp(L, LUA_REGISTRYINDEX, &CallableGc<Callable>::tag);
+    }
+    lua_setmetatable(L, -2);
+  }
+  lua_pushcclosure(
+    L, &CallSignature<decltype(&Callable::operator())>::template
+         trampoline<Callable>, 1);
+}
+
+} // namespace luawrapper_detail
+
+////////////////////////////////////////////////////////////////////////////////
+// LuaStruct: field descriptor for marshalling a C++ struct to and from a lua
+// table with LuaWrapper::pushStruct/readStruct. Declare it once per struct,
+// listing member pointers in a fixed order with any LuaStack supported type
+// except C strings (read back they would point into popped lua strings, use
+// std::string):
+//
+//   template <> struct LuaStruct<Config> {
+//     template <class V> static void fields(V& v) {
+//       v("width", &Config::width);
+//       v("name",  &Config::name);
+//     }
+//   };
+//
+// Field name strings are interned once per state in a registry array, after
+// that each field costs two raw lookups and no string push.
+////////////////////////////////////////////////////////////////////////////////
+
+template <class T>
+struct LuaStruct;
+
+namespace luawrapper_detail {
+
+// unique registry key for the field name array of each struct type
+template <class T>
+struct StructKeys { static char tag; };
+template <class T>
+char StructKeys<T>::tag;
+
+struct KeyCollector {
+  lua_State* L;
+  int        keys;
+  int        n;
+  template <class T, class F>
+  void operator()(const char* name, F T::*) {
+    static_assert(!std::is_same<typename std::decay<F>::type, char*>::value &&
+                  !std::is_same<typename std::decay<F>::type,
+                                const char*>::value,
+                  "LuaStruct: use std::string for string fields");
+    lua_pushstring(L, name);
+    lua_rawseti(L, keys, ++n);
+  }
+};
+
+template <class T>
+struct FieldPusher {
+  lua_State* L;
+  int        keys;
+  int        table;
+  int        n;
+  const T*   obj;
+  template <class F>
+  void operator()(const char*, F T::* field) {
+    lua_rawgeti(L, keys, ++n);
+    LuaStack<F>::push(L, obj->*field);
+    lua_rawset(L, table);
+  }
+};
+
+template <class T>
+struct FieldReader {
+  lua_State* L;
+  int        keys;
+  int        table;
+  int        n;
+  T*         obj;
+  template <class F>
+  void operator()(const char*, F T::* field) {
+    lua_rawgeti(L, keys, ++n);
+    lua_rawget(L, table);
+    if (!lua_isnil(L, -1))
+      obj->*field = LuaStack<F>::to(L, -1);
+    lua_pop(L, 1);
+  }
+};
+
+// pushStructKeys: pushes the interned field name array of T, creating it on
+// the first use in this state
+template <class T>
+inline int pushStructKeys(lua_State* L) {
+  if (lua_rawgetp(L, LUA_REGISTRYINDEX, &StructKeys<T>::tag) == LUA_TNIL) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    KeyCollector collect = { L, lua_gettop(L), 0 };
+    LuaStruct<T>::fields(collect);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &StructKeys<T>::tag);
+  }
+  return (int)lua_rawlen(L, -1);
+}
+
+} // namespace luawrapper_detail
+
+////////////////////////////////////////////////////////////////////////////////
+// LuaRefSlab: registry slots reserved in batches and recycled on the C++ side,
+// so persistent references never go through the luaL_ref/luaL_unref freelist
+// in steady state. Free slots hold false so their old values can be collected.
+////////////////////////////////////////////////////////////////////////////////
+
+class LuaRefSlab {
+
+public:
+  enum { BATCH = 64 }; // slots reserved from the registry at a time
+
+  LuaRefSlab() : m_luastate(NULL) {}
+
+  LuaRefSlab(const LuaRefSlab&) = delete;
+  LuaRefSlab& operator=(const LuaRefSlab&) = delete;
+
+  void setLuaState(lua_State* L) { m_luastate = L; }
+
+  int  store();          // pops top of stack into a slot and returns the slot
+  void free(int slot);   // clears the slot and makes it reusable
+  void push(int slot) const {
+    lua_rawgeti(m_luastate, LUA_REGISTRYINDEX, slot);
+  }
+  void trim(size_t keep = BATCH); // returns spare slots to the registry
+  size_t spare() const { return m_free.size(); }
+
+private:
+  void reserve();
+
+  lua_State*       m_luastate;
+  std::vector<int> m_free; // reserved registry slots holding false
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// LuaRef: persistent RAII reference to a lua value, can be pushed any number
+// of times and frees its slot on release or destruction. Must not outlive the
+// LuaWrapper that created it.
+////////////////////////////////////////////////////////////////////////////////
+
+class LuaRef {
+
+public:
+  LuaRef() : m_slab(NULL), m_slot(LUA_NOREF) {}
+  LuaRef(LuaRef&& other) : m_slab(other.m_slab), m_slot(other.m_slot) {
+    other.m_slab = NULL;
+    other.m_slot = LUA_NOREF;
+  }
+  LuaRef& operator=(LuaRef&& other) {
+    if (this != &other) {
+      release();
+      m_slab = other.m_slab;
+      m_slot = other.m_slot;
+      other.m_slab = NULL;
+      other.m_slot = LUA_NOREF;
+    }
+    return *this;
+  }
+  ~LuaRef() { release(); }
+
+  LuaRef(const LuaRef&) = delete;
+  LuaRef& operator=(const LuaRef&) = delete;
+
+  bool isValid() const { return m_slab != NULL; }
+
+  // pushes the referenced value, nil references push nil
+  void push() const {
+    m_slab->push(m_slot);
+  }
+
+  // frees the slot, the reference becomes invalid
+  void release() {
+    if (m_slab)
+      m_slab->free(m_slot);
+    m_slab = NULL;
+    m_slot = LUA_NOREF;
+  }
+
+private:
+  friend class LuaWrapper;
+  LuaRef(LuaRefSlab* slab, int slot) : m_slab(slab), m_slot(slot) {}
+
+  LuaRefSlab* m_slab;
+  int         m_slot;
+};
+
+// store: pops value on top of stack into a free slot, nil values are not
+// stored and use LUA_REFNIL which always pushes nil
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaRefSlab::store() {
+  if (lua_isnil(m_luastate, -1)) {
+    lua_pop(m_luastate, 1);
+    return LUA_REFNIL;
+  }
+  if (m_free.empty())
+    reserve();
+  int slot = m_free.back();
+  m_free.pop_back();
+  lua_rawseti(m_luastate, LUA_REGISTRYINDEX, slot);
+  return slot;
+}
+
+// free: drops the slot value and keeps the slot reserved for reuse
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaRefSlab::free(int slot) {
+  if (slot == LUA_REFNIL || slot == LUA_NOREF)
+    return;
+  lua_pushboolean(m_luastate, 0);
+  lua_rawseti(m_luastate, LUA_REGISTRYINDEX, slot);
+  m_free.push_back(slot);
+}
+
+// reserve: takes BATCH slots from the registry at once
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaRefSlab::reserve() {
+  m_free.reserve(m_free.size() + BATCH);
+  for (int i = 0; i < BATCH; i++) {
+    lua_pushboolean(m_luastate, 0);
+    m_free.push_back(luaL_ref(m_luastate, LUA_REGISTRYINDEX));
+  }
+}
+
+// trim: returns spare slots above "keep" to the registry in one pass
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaRefSlab::trim(size_t keep) {
+  while (m_free.size() > keep) {
+    luaL_unref(m_luastate, LUA_REGISTRYINDEX, m_free.back());
+    m_free.pop_back();
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// LuaBytecodeCache: compiled chunks keyed by script path, modification time
+// (ns where available) and size, kept in memory and optionally in a cache
+// directory. Bytecode does not depend on the state, so one cache is shared by
+// all wrappers and is thread safe.
+////////////////////////////////////////////////////////////////////////////////
+
+class LuaBytecodeCache {
+
+public:
+  typedef std::shared_ptr<const std::string> Chunk;
+
+  LuaBytecodeCache() {}
+
+  LuaBytecodeCache(const LuaBytecodeCache&) = delete;
+  LuaBytecodeCache& operator=(const LuaBytecodeCache&) = delete;
+
+  // process wide cache used by LuaWrapper::doFileCached by default
+  static LuaBytecodeCache& global() {
+    static LuaBytecodeCache cache;
+    return cache;
+  }
+
+  // enables the on-disk cache in an existing directory, empty disables it
+  void setDirectory(const std::string& dir);
+
+  // finds bytecode for path with the given stamp, NULL on misses
+  Chunk find(const std::string& path, int64_t mtime, int64_t size);
+  void  insert(const std::string& path, int64_t mtime, int64_t size,
+               const std::string& bytecode);
+  void  erase(const std::string& path);
+  void  clear();
+
+private:
+  struct Entry {
+    int64_t mtime;
+    int64_t size;
+    Chunk   bytecode;
+  };
+
+  // on-disk file header, followed by the script path and the bytecode
+  struct DiskHeader {
+    char     magic[8];
+    int64_t  mtime;
+    int64_t  size;
+    uint32_t pathlen;
+  };
+
+  std::string diskPath(const std::string& path) const;
+  Chunk readDisk(const std::string& path, int64_t mtime, int64_t size) const;
+  void  writeDisk(const std::string& path, int64_t mtime, int64_t size,
+                  const std::string& bytecode) const;
+
+  mutable std::mutex                     m_mutex;
+  std::unordered_map<std::string, Entry> m_entries;
+  std::string                            m_dir;
+};
+
+// setDirectory: sets directory for the on-disk cache
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaBytecodeCache::setDirectory(const std::string& dir) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_dir = dir;
+}
+
+// find: looks the chunk up in memory first and then on disk, stale entries
+// (different mtime or size) are misses
+////////////////////////////////////////////////////////////////////////////////
+inline LuaBytecodeCache::Chunk
+LuaBytecodeCache::find(const std::string& path, int64_t mtime, int64_t size) {
+  std::string dir;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::unordered_map<std::string, Entry>::iterator it = m_entries.find(path);
+    if (it != m_entries.end() &&
+        it->second.mtime == mtime && it->second.size == size)
+      return it->second.bytecode;
+    dir = m_dir;
+  }
+  if (dir.empty())
+    return Chunk();
+
+  Chunk chunk = readDisk(path, mtime, size);
+  if (chunk) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Entry& e = m_entries[path];
+    e.mtime    = mtime;
+    e.size     = size;
+    e.bytecode = chunk;
+  }
+  return chunk;
+}
+
+// insert: stores bytecode in memory and in the cache directory if set
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaBytecodeCache::insert(const std::string& path, int64_t mtime,
+                                     int64_t size,
+                                     const std::string& bytecode) {
+  bool todisk;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Entry& e = m_entries[path];
+    e.mtime    = mtime;
+    e.size     = size;
+    e.bytecode = std::make_shared<const std::string>(bytecode);
+    todisk = !m_dir.empty();
+  }
+  if (todisk)
+    writeDisk(path, mtime, size, bytecode);
+}
+
+// erase: drops the in-memory entry for path
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaBytecodeCache::erase(const std::string& path) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_entries.erase(path);
+}
+
+// clear: drops all in-memory entries
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaBytecodeCache::clear() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_entries.clear();
+}
+
+// diskPath: cache file name, FNV-1a hash of the script path
+////////////////////////////////////////////////////////////////////////////////
+inline std::string LuaBytecodeCache::diskPath(const std::string& path) const {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < path.size(); i++) {
+    hash ^= (unsigned char)path[i];
+    hash *= 1099511628211ULL;
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx.luac", (unsigned long long)hash);
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_dir + name;
+}
+
+// readDisk: reads cache file, checking it was written for this path and stamp
+////////////////////////////////////////////////////////////////////////////////
+inline LuaBytecodeCache::Chunk
+LuaBytecodeCache::readDisk(const std::string& path, int64_t mtime,
+                           int64_t size) const {
+  FILE* fp = fopen(diskPath(path).c_str(), "rb");
+  if (!fp)
+    return Chunk();
+
+  Chunk chunk;
+  DiskHeader h;
+  std::string storedpath;
+  if (fread(&h, sizeof(h), 1, fp) == 1 &&
+      memcmp(h.magic, "LWBC0001", 8) == 0 &&
+      h.mtime == mtime && h.size == size && h.pathlen == path.size()) {
+    storedpath.resize(h.pathlen);
+    if (fread(&storedpath[0], 1, h.pathlen, fp) == h.pathlen &&
+        storedpath == path) {
+      std::string bytecode;
+      char buf[8192];
+      size_t n;
+      while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        bytecode.append(buf, n);
+      if (!bytecode.empty())
+        chunk = std::make_shared<const std::string>(std::move(bytecode));
+    }
+  }
+  fclose(fp);
+  return chunk;
+}
+
+// writeDisk: writes cache file through a temporary file renamed into place so
+// concurrent readers never see a partial file
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaBytecodeCache::writeDisk(const std::string& path, int64_t mtime,
+                                        int64_t size,
+                                        const std::string& bytecode) const {
+  std::string file = diskPath(path);
+  char suffix[48];
+  snprintf(suffix, sizeof(suffix), ".%zx.%llx.tmp",
+           std::hash<std::thread::id>()(std::this_thread::get_id()),
+           (unsigned long long)
+             std::chrono::steady_clock::now().time_since_epoch().count());
+  std::string tmp = file + suffix;
+
+  FILE* fp = fopen(tmp.c_str(), "wb");
+  if (!fp)
+    return;
+
+  DiskHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, "LWBC0001", 8);
+  h.mtime   = mtime;
+  h.size    = size;
+  h.pathlen = (uint32_t)path.size();
+  bool ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+            fwrite(path.data(), 1, path.size(), fp) == path.size() &&
+            fwrite(bytecode.data(), 1, bytecode.size(), fp) == bytecode.size();
+  ok = fclose(fp) == 0 && ok;
+
+  if (!ok || rename(tmp.c_str(), file.c_str()) != 0)
+    remove(tmp.c_str());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// LuaBundle: read only archive of lua modules (source or bytecode) in one
+// file, mapped into memory so modules are loaded straight from the page cache
+// with a single open for the whole bundle. Layout, in host byte order:
+//
+//   "LWBN0001" | uint32 count | uint32 0 | count index entries sorted by name
+//   index entry: uint32 name offset | uint32 name length |
+//                uint64 data offset | uint64 data size (offsets from start)
+//   followed by the names and module data
+//
+// Lookups binary search the index. See luabundle.cpp for the packer.
+////////////////////////////////////////////////////////////////////////////////
+
+class LuaBundle {
+
+public:
+  struct Module {
+    std::string name; // dotted module name as passed to require
+    std::string data; // source or bytecode
+  };
+
+  LuaBundle() : m_base(NULL), m_size(0), m_count(0) {}
+  explicit LuaBundle(const char* filename)
+  : m_base(NULL), m_size(0), m_count(0) { open(filename); }
+  ~LuaBundle() { close(); }
+
+  LuaBundle(const LuaBundle&) = delete;
+  LuaBundle& operator=(const LuaBundle&) = delete;
+
+  // maps and validates a bundle file, closing the previous one
+  bool   open(const char* filename);
+  void   close();
+  bool   isOpen() const { return m_base != NULL; }
+  size_t size() const   { return m_count; }
+
+  // finds module name, data points into the mapping and lives until close
+  bool find(const char* name, const char*& data, size_t& size) const;
+  std::string name(size_t i) const; // i-th module in index order
+
+  // writes modules as a bundle, atomically replacing filename so processes
+  // that have the old bundle mapped keep a valid file
+  static bool write(const char* filename, std::vector<Module> modules);
+
+private:
+  struct Header {
+    char     magic[8];
+    uint32_t count;
+    uint32_t reserved;
+  };
+
+  struct Index {
+    uint32_t nameoff;
+    uint32_t namelen;
+    uint64_t dataoff;
+    uint64_t datasize;
+  };
+
+  const Index* index() const {
+    return (const Index*)(m_base + sizeof(Header));
+  }
+  int compare(const Index& e, const char* name, size_t len) const;
+
+  const char* m_base;
+  size_t      m_size;
+  size_t      m_count;
+#ifdef _WIN32
+  std::string m_contents;
+#endif
+};
+
+// open: maps filename and checks that the index is in bounds and sorted, so
+// lookups need no further checks
+////////////////////////////////////////////////////////////////////////////////
+inline bool LuaBundle::open(const char* filename) {
+  close();
+#ifdef _WIN32
+  FILE* fp = fopen(filename, "rb");
+  if (!fp)
+    return false;
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    m_contents.append(buf, n);
+  fclose(fp);
+  m_base = m_contents.data();
+  m_size = m_contents.size();
+#else
+  int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  void* map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(Header))
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED)
+    return false;
+  m_base = (const char*)map;
+  m_size = (size_t)st.st_size;
+#endif
+
+  Header h;
+  bool ok = m_size >= sizeof(Header);
+  if (ok) {
+    memcpy(&h, m_base, sizeof(h));
+    ok = memcmp(h.magic, "LWBN0001", 8) == 0 &&
+         h.count <= (m_size - sizeof(Header)) / sizeof(Index);
+  }
+  for (uint32_t i = 0; ok && i < h.count; i++) {
+    const Index& e = index()[i];
+    ok = e.nameoff <= m_size && e.namelen <= m_size - e.nameoff &&
+         e.dataoff <= m_size && e.datasize <= m_size - e.dataoff;
+    if (ok && i > 0) {
+      const Index& prev = index()[i - 1];
+      ok = compare(prev, m_base + e.nameoff, e.namelen) < 0;
+    }
+  }
+  if (!ok) {
+    close();
+    return false;
+  }
+  m_count = h.count;
+  return true;
+}
+
+// close: unmaps the bundle, module data found before becomes invalid
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaBundle::close() {
+#ifdef _WIN32
+  m_contents.clear();
+#else
+  if (m_base)
+    munmap((void*)m_base, m_size);
+#endif
+  m_base  = NULL;
+  m_size  = 0;
+  m_count = 0;
+}
+
+// compare: orders entry e against name like memcmp over the shorter length,
+// then by length
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaBundle::compare(const Index& e, const char* name,
+                              size_t len) const {
+  int c = memcmp(m_base + e.nameoff, name, e.namelen < len ? e.namelen : len);
+  if (c != 0)
+    return c;
+  return e.namelen < len ? -1 : (e.namelen > len ? 1 : 0);
+}
+
+// find: binary search of the index
+////////////////////////////////////////////////////////////////////////////////
+inline bool LuaBundle::find(const char* name, const char*& data,
+                            size_t& size) const {
+  size_t len = strlen(name);
+  size_t lo = 0, hi = m_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    int c = compare(index()[mid], name, len);
+    if (c == 0) {
+      data = m_base + index()[mid].dataoff;
+      size = (size_t)index()[mid].datasize;
+      return true;
+    }
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return false;
+}
+
+// name: name of the i-th module
+////////////////////////////////////////////////////////////////////////////////
+inline std::string LuaBundle::name(size_t i) const {
+  if (i >= m_count)
+    return std::string();
+  return std::string(m_base + index()[i].nameoff, index()[i].namelen);
+}
+
+// write: sorts modules by name and writes header, index, names and data to a
+// temporary file renamed over filename. Fails on duplicate names.
+////////////////////////////////////////////////////////////////////////////////
+inline bool LuaBundle::write(const char* filename,
+                             std::vector<Module> modules) {
+  struct ByName {
+    bool operator()(const Module& a, const Module& b) const {
+      int c = memcmp(a.name.data(), b.name.data(),
+                     a.name.size() < b.name.size() ? a.name.size()
+                                                   : b.name.size());
+      return c != 0 ? c < 0 : a.name.size() < b.name.size();
+    }
+  };
+  std::sort(modules.begin(), modules.end(), ByName());
+  for (size_t i = 1; i < modules.size(); i++) {
+    if (modules[i].name == modules[i - 1].name)
+      return false;
+  }
+
+  Header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, "LWBN0001", 8);
+  h.count = (uint32_t)modules.size();
+
+  std::vector<Index> idx(modules.size());
+  uint64_t off = sizeof(Header) + modules.size() * sizeof(Index);
+  for (size_t i = 0; i < modules.size(); i++) {
+    idx[i].nameoff = (uint32_t)off;
+    idx[i].namelen = (uint32_t)modules[i].name.size();
+    off += modules[i].name.size();
+  }
+  if (off > 0xffffffffu)
+    return false; // names must be addressable with 32 bit offsets
+  for (size_t i = 0; i < modules.size(); i++) {
+    idx[i].dataoff  = off;
+    idx[i].datasize = modules[i].data.size();
+    off += modules[i].data.size();
+  }
+
+  std::string tmp = std::string(filename) + ".tmp";
+  FILE* fp = fopen(tmp.c_str(), "wb");
+  if (!fp)
+    return false;
+  bool ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+            (idx.empty() ||
+             fwrite(&idx[0], sizeof(Index), idx.size(), fp) == idx.size());
+  for (size_t i = 0; ok && i < modules.size(); i++) {
+    const std::string& n = modules[i].name;
+    ok = fwrite(n.data(), 1, n.size(), fp) == n.size();
+  }
+  for (size_t i = 0; ok && i < modules.size(); i++) {
+    const std::string& d = modules[i].data;
+    ok = fwrite(d.data(), 1, d.size(), fp) == d.size();
+  }
+  ok = fclose(fp) == 0 && ok;
+
+  if (ok) {
+#ifdef _WIN32
+    remove(filename); // rename does not replace on windows
+#endif
+    ok = rename(tmp.c_str(), filename) == 0;
+  }
+  if (!ok)
+    remove(tmp.c_str());
+  return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// LuaStringView: pointer and length of a lua string that stays anchored in the
+// registry for as long as the view lives, so it cannot be collected and needs
+// neither a copy nor strlen. Must not outlive the LuaWrapper that created it.
+////////////////////////////////////////////////////////////////////////////////
+
+class LuaStringView {
+
+public:
+  LuaStringView() : m_data(NULL), m_size(0) {}
+  LuaStringView(LuaStringView&& other)
+  : m_data(other.m_data), m_size(other.m_size),
+    m_anchor(std::move(other.m_anchor)) {
+    other.m_data = NULL;
+    other.m_size = 0;
+  }
+  LuaStringView& operator=(LuaStringView&& other) {
+    if (this != &other) {
+      m_data   = other.m_data;
+      m_size   = other.m_size;
+      m_anchor = std::move(other.m_anchor);
+      other.m_data = NULL;
+      other.m_size = 0;
+    }
+    return *this;
+  }
+
+  LuaStringView(const LuaStringView&) = delete;
+  LuaStringView& operator=(const LuaStringView&) = delete;
+
+  const char* data() const  { return m_data; }
+  size_t      size() const  { return m_size; }
+  bool        empty() const { return m_size == 0; }
+  std::string str() const {
+    return m_data ? std::string(m_data, m_size) : std::string();
+  }
+#if __cplusplus >= 201703L
+  operator std::string_view() const {
+    return std::string_view(m_data ? m_data : "", m_size);
+  }
+#endif
+
+private:
+  friend class LuaWrapper;
+
+  const char* m_data;
+  size_t      m_size;
+  LuaRef      m_anchor;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// LuaBudget: bounds for a single callFunction, a wall clock deadline and/or a
+// number of VM instructions, checked every "granularity" instructions or
+// sooner when fewer instructions are left. Hooks are per thread: coroutines
+// created during the call inherit the hook, and coroutine.resume and
+// coroutine.wrap arm older ones before resuming them, so every coroutine the
+// call runs is bounded. The hook a coroutine keeps removes itself the next
+// time it fires after the call.
+////////////////////////////////////////////////////////////////////////////////
+
+struct LuaBudget {
+  typedef std::chrono::steady_clock clock;
+
+  clock::time_point  deadline;     // clock::time_point::max() for none
+  unsigned long long instructions; // 0 for no limit
+  int                granularity;  // instructions between checks
+
+  LuaBudget()
+  : deadline(clock::time_point::max()), instructions(0), granularity(1000) {}
+
+  // budget expiring "timeout" from now
+  template <class Rep, class Period>
+  static LuaBudget after(std::chrono::duration<Rep, Period> timeout) {
+    LuaBudget b;
+    b.deadline = clock::now() + timeout;
+    return b;
+  }
+
+  // budget of n instructions
+  static LuaBudget count(unsigned long long n) {
+    LuaBudget b;
+    b.instructions = n;
+    return b;
+  }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// LuaProfiler: sampling profiler of a LuaWrapper state. While running, the
+// wrapper's count hook samples the lua call stack every "period" VM
+// instructions and counts identical stacks, which are written in collapsed
+// stack format ("outer;inner count" lines) for flamegraph.pl and similar
+// tools. Starting and stopping may happen on any thread (e.g. a control
+// thread of a busy server): they only publish the atomic flag and period,
+// the state's own thread installs the hook. It does so when it next enters
+// lua through the wrapper, on every thread resumed by coroutine.resume,
+// coroutine.wrap or LuaScheduler, and wherever a budget hook fires. A call
+// already running unhooked is only sampled from its next such point.
+// samples(), collapsed() and clear() read the stacks the hook writes, so
+// call them on the thread running the state or while it is idle.
+////////////////////////////////////////////////////////////////////////////////
+
+class LuaProfiler {
+
+public:
+  enum { DEFAULT_PERIOD = 10000, MAX_DEPTH = 64 };
+
+  LuaProfiler() : m_running(false), m_period(DEFAULT_PERIOD),
+                  m_countdown(INT64_MAX), m_samples(0) {}
+
+  LuaProfiler(const LuaProfiler&) = delete;
+  LuaProfiler& operator=(const LuaProfiler&) = delete;
+
+  bool running() const {
+    return m_running.load(std::memory_order_acquire);
+  }
+  int  period() const { return m_period.load(std::memory_order_relaxed); }
+  unsigned long long samples() const { return m_samples; }
+
+  void        clear();                  // drops collected samples
+  std::string collapsed() const;        // collapsed stacks, one per line
+  bool        writeCollapsed(const char* filename) const;
+
+private:
+  friend class LuaWrapper;
+
+  void start(int period);
+  void stop() { m_running.store(false, std::memory_order_release); }
+  // charges n instructions, sampling L when the period is used up. The
+  // countdown belongs to the hook, a shorter period set meanwhile clamps it.
+  void tick(lua_State* L, int n) {
+    long long p = period();
+    if (m_countdown > p)
+      m_countdown = p;
+    m_countdown -= n;
+    if (m_countdown <= 0) {
+      m_countdown = m_countdown + p > 0 ? m_countdown + p : p;
+      sample(L);
+    }
+  }
+  void sample(lua_State* L);
+
+  std::atomic<bool>                                      m_running;
+  std::atomic<int>                                       m_period;
+  long long                                              m_countdown;
+  unsigned long long                                     m_samples;
+  std::string                                            m_key; // reused
+  std::vector<std::string>                               m_frames;
+  std::unordered_map<std::string, unsigned long long>    m_stacks;
+};
+
+// start: starts sampling every period instructions, the hook picks the new
+// period up on its next call
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaProfiler::start(int period) {
+  m_period.store(period > 0 ? period : DEFAULT_PERIOD,
+                 std::memory_order_relaxed);
+  m_running.store(true, std::memory_order_release);
+}
+
+// clear: drops collected samples
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaProfiler::clear() {
+  m_stacks.clear();
+  m_samples = 0;
+}
+
+// sample: walks the stack innermost first and counts it under its collapsed
+// key, root first. Frames are "name@source:line" of the function definition.
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaProfiler::sample(lua_State* L) {
+  lua_Debug ar;
+  int depth = 0;
+  while (depth < MAX_DEPTH && lua_getstack(L, depth, &ar)) {
+    lua_getinfo(L, "Sn", &ar);
+    if ((int)m_frames.size() <= depth)
+      m_frames.push_back(std::string());
+    std::string& frame = m_frames[depth];
+    frame.assign(ar.name ? ar.name : (*ar.what == 'm' ? "main" : "?"));
+    if (*ar.what == 'C') {
+      frame.append("@[C]");
+    } else {
+      char line[16];
+      snprintf(line, sizeof(line), ":%d", ar.linedefined);
+      frame.append("@").append(ar.short_src).append(line);
+    }
+    for (size_t i = 0; i < frame.size(); i++)
+      if (frame[i] == ';' || frame[i] == ' ')
+        frame[i] = '_';
+    depth++;
+  }
+  if (depth == 0)
+    return;
+
+  m_key.clear();
+  for (int i = depth - 1; i >= 0; i--) {
+    m_key.append(m_frames[i]);
+    if (i > 0)
+      m_key.push_back(';');
+  }
+  m_stacks[m_key]++;
+  m_samples++;
+}
+
+// collapsed: returns the samples in collapsed stack format
+////////////////////////////////////////////////////////////////////////////////
+inline std::string LuaProfiler::collapsed() const {
+  std::string out;
+  char count[32];
+  std::unordered_map<std::string, unsigned long long>::const_iterator it;
+  for (it = m_stacks.begin(); it != m_stacks.end(); ++it) {
+    snprintf(count, sizeof(count), " %llu\n", it->second);
+    out.append(it->first).append(count);
+  }
+  return out;
+}
+
+// writeCollapsed: writes collapsed stacks to filename, false on I/O errors
+////////////////////////////////////////////////////////////////////////////////
+inline bool LuaProfiler::writeCollapsed(const char* filename) const {
+  FILE* fp = fopen(filename, "w");
+  if (!fp)
+    return false;
+  std::string out = collapsed();
+  bool ok = fwrite(out.data(), 1, out.size(), fp) == out.size();
+  return fclose(fp) == 0 && ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// LuaHistogram: log bucketed latency histogram in the HDR style, values below
+// 2^SUB_BITS have their own bucket and every power of two above is split in
+// 2^SUB_BITS buckets (12.5% relative error). Counters are relaxed atomics so
+// other threads can read while the owning thread records.
+////////////////////////////////////////////////////////////////////////////////
+
+class LuaHistogram {
+
+public:
+  enum {
+    SUB_BITS = 3,
+    SUB      = 1 << SUB_BITS,
+    BUCKETS  = (64 - SUB_BITS + 1) * SUB
+  };
+
+  LuaHistogram() {
+    for (int i = 0; i < BUCKETS; i++)
+      m_buckets[i].store(0, std::memory_order_relaxed);
+  }
+
+  LuaHistogram(const LuaHistogram&) = delete;
+  LuaHistogram& operator=(const LuaHistogram&) = delete;
+
+  void record(uint64_t value) {
+    m_buckets[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // copies the bucket counts, safe from any thread
+  void snapshot(uint64_t counts[BUCKETS]) const {
+    for (int i = 0; i < BUCKETS; i++)
+      counts[i] = m_buckets[i].load(std::memory_order_relaxed);
+  }
+
+  // value at quantile q (0..1) of snapshot counts, the bucket lower bound
+  static uint64_t percentile(const uint64_t counts[BUCKETS], double q);
+
+  static int bucket(uint64_t value) {
+    if (value < SUB)
+      return (int)value;
+    int e = 63 - __builtin_clzll(value);
+    return (e - SUB_BITS + 1) * SUB +
+           (int)((value >> (e - SUB_BITS)) & (SUB - 1));
+  }
+
+  static uint64_t lowerBound(int index) {
+    if (index < SUB)
+      return (uint64_t)index;
+    int e = index / SUB + SUB_BITS - 1;
+    return (uint64_t)(SUB + index % SUB) << (e - SUB_BITS);
+  }
+
+private:
+  std::atomic<uint64_t> m_buckets[BUCKETS];
+};
+
+// percentile: walks the cumulative counts up to quantile q
+////////////////////////////////////////////////////////////////////////////////
+inline uint64_t LuaHistogram::percentile(const uint64_t counts[BUCKETS],
+                                         double q) {
+  uint64_t total = 0;
+  for (int i = 0; i < BUCKETS; i++)
+    total += counts[i];
+  if (total == 0)
+    return 0;
+
+  uint64_t rank = (uint64_t)(q * (double)total);
+  if (rank >= total)
+    rank = total - 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < BUCKETS; i++) {
+    seen += counts[i];
+    if (seen > rank)
+      return lowerBound(i);
+  }
+  return lowerBound(BUCKETS - 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// LuaCallStats: opt-in per-function call counts, error counts and latency
+// histograms (ns) recorded by callFunction and doFile. Entries are only ever
+// appended to a lock free list, so snapshot() may run on any thread while the
+// state keeps calling; everything else belongs to the state's thread.
+////////////////////////////////////////////////////////////////////////////////
+
+class LuaCallStats {
+
+public:
+  struct Entry {
+    std::string           name;  // global name or file, plus definition
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> errors;
+    std::atomic<uint64_t> totalNs;
+    LuaHistogram          latency;
+    Entry*                next;
+
+    void record(uint64_t ns, bool failed) {
+      calls.fetch_add(1, std::memory_order_relaxed);
+      if (failed)
+        errors.fetch_add(1, std::memory_order_relaxed);
+      totalNs.fetch_add(ns, std::memory_order_relaxed);
+      latency.record(ns);
+    }
+  };
+
+  struct Snapshot {
+    std::string name;
+    uint64_t    calls;
+    uint64_t    errors;
+    uint64_t    totalNs;
+    uint64_t    p50Ns;
+    uint64_t    p99Ns;
+    uint64_t    maxNs; // lower bound of the highest bucket
+  };
+
+  LuaCallStats() : m_enabled(false), m_head(NULL), m_hintptr(NULL) {}
+  ~LuaCallStats();
+
+  LuaCallStats(const LuaCallStats&) = delete;
+  LuaCallStats& operator=(const LuaCallStats&) = delete;
+
+  bool enabled() const { return m_enabled; }
+  void setEnabled(bool enabled) { m_enabled = enabled; }
+
+  // copies counters and percentiles of every entry, safe from any thread
+  std::vector<Snapshot> snapshot() const;
+
+private:
+  friend class LuaWrapper;
+
+  Entry* entryFor(lua_State* L, int index); // function at stack index
+  Entry* entryFor(const char* filename);
+  Entry* append(const std::string& name);
+  void   hint(lua_State* L, const char* name); // name of global just fetched
+  static int remember(lua_State* L); // caches a function's entry
+
+  bool                                        m_enabled;
+  std::atomic<Entry*>                         m_head;
+  std::unordered_map<std::string, Entry*>     m_functions;
+  std::unordered_map<std::string, Entry*>     m_files;
+  const void*                                 m_hintptr;
+  std::string                                 m_hint;
+};
+
+// Destructor - frees all entries
+inline LuaCallStats::~LuaCallStats() {
+  Entry* e = m_head.load(std::memory_order_acquire);
+  while (e) {
+    Entry* next = e->next;
+    delete e;
+    e = next;
+  }
+}
+
+// snapshot: reads every published entry with relaxed counter loads
+////////////////////////////////////////////////////////////////////////////////
+inline std::vector<LuaCallStats::Snapshot> LuaCallStats::snapshot() const {
+  std::vector<Snapshot> out;
+  uint64_t counts[LuaHistogram::BUCKETS];
+  for (const Entry* e = m_head.load(std::memory_order_acquire); e;
+       e = e->next) {
+    Snapshot snap;
+    snap.name    = e->name;
+    snap.calls   = e->calls.load(std::memory_order_relaxed);
+    snap.errors  = e->errors.load(std::memory_order_relaxed);
+    snap.totalNs = e->totalNs.load(std::memory_order_relaxed);
+    e->latency.snapshot(counts);
+    snap.p50Ns = LuaHistogram::percentile(counts, 0.50);
+    snap.p99Ns = LuaHistogram::percentile(counts, 0.99);
+    snap.maxNs = 0;
+    for (int i = LuaHistogram::BUCKETS - 1; i >= 0; i--) {
+      if (counts[i]) {
+        snap.maxNs = LuaHistogram::lowerBound(i);
+        break;
+      }
+    }
+    out.push_back(snap);
+  }
+  return out;
+}
+
+// entryFor: entry of the function at stack index. Functions seen before are
+// found by identity in a weak keyed registry table, so repeated calls skip
+// lua_getinfo and a collected function's slot cannot be inherited. New ones
+// are grouped by the global they were fetched as, if known, where they are
+// defined and their shape (last line, parameters, upvalues; the address of
+// C functions), which keeps closures of one prototype in one bounded entry.
+// Only functions alike in all of these on one line still share an entry.
+// Anything but a function is counted under "?".
+////////////////////////////////////////////////////////////////////////////////
+inline LuaCallStats::Entry* LuaCallStats::entryFor(lua_State* L, int index) {
+  index = lua_absindex(L, index);
+  const void* hinted = m_hintptr;
+  m_hintptr = NULL; // consumed, the function may be collected after the call
+  std::string name("?");
+  std::string key("?");
+  if (lua_isfunction(L, index)) {
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, this) == LUA_TTABLE) {
+      lua_pushvalue(L, index);
+      lua_rawget(L, -2);
+      Entry* known = (Entry*)lua_touserdata(L, -1);
+      lua_pop(L, 2);
+      if (known)
+        return known;
+    } else {
+      lua_pop(L, 1);
+    }
+
+    if (lua_topointer(L, index) == hinted)
+      name = m_hint;
+    lua_Debug ar;
+    lua_pushvalue(L, index);
+    lua_getinfo(L, ">Su", &ar);
+    char line[64];
+    snprintf(line, sizeof(line), ":%d", ar.linedefined);
+    name.append("@").append(ar.short_src).append(line);
+    if (lua_iscfunction(L, index))
+      snprintf(line, sizeof(line), "#%p",
+               (void*)(uintptr_t)lua_tocfunction(L, index));
+    else
+      snprintf(line, sizeof(line), "#%d/%d/%d%s", ar.lastlinedefined,
+               (int)ar.nparams, (int)ar.nups, ar.isvararg ? "+" : "");
+    key = name + line;
+  }
+
+  Entry* e;
+  std::unordered_map<std::string, Entry*>::iterator it =
+    m_functions.find(key);
+  if (it != m_functions.end()) {
+    e = it->second;
+  } else {
+    e = append(name);
+    m_functions[key] = e;
+  }
+  if (key != "?" && lua_checkstack(L, 4)) {
+    lua_pushcfunction(L, &LuaCallStats::remember);
+    lua_pushlightuserdata(L, this);
+    lua_pushvalue(L, index);
+    lua_pushlightuserdata(L, e);
+    if (lua_pcall(L, 3, 0, 0) != 0)
+      lua_pop(L, 1); // out of memory, looked up by name again next time
+  }
+  return e;
+}
+
+// remember: stores lightuserdata entry (3) for function (2) in the weak
+// keyed table at registry[lightuserdata (1)], creating it first. Runs in a
+// protected call as callers are outside one.
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaCallStats::remember(lua_State* L) {
+  void* key = lua_touserdata(L, 1);
+  if (lua_rawgetp(L, LUA_REGISTRYINDEX, key) != LUA_TTABLE) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, key);
+  }
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, 3);
+  lua_rawset(L, -3);
+  return 0;
+}
+
+// entryFor: entry of a script file run through doFile
+////////////////////////////////////////////////////////////////////////////////
+inline LuaCallStats::Entry* LuaCallStats::entryFor(const char* filename) {
+  std::string name(filename);
+  std::unordered_map<std::string, Entry*>::iterator it = m_files.find(name);
+  if (it != m_files.end())
+    return it->second;
+  Entry* e = append(name);
+  m_files[name] = e;
+  return e;
+}
+
+// append: creates an entry and publishes it at the head of the list
+////////////////////////////////////////////////////////////////////////////////
+inline LuaCallStats::Entry* LuaCallStats::append(const std::string& name) {
+  Entry* e = new Entry();
+  e->name = name;
+  e->calls.store(0, std::memory_order_relaxed);
+  e->errors.store(0, std::memory_order_relaxed);
+  e->totalNs.store(0, std::memory_order_relaxed);
+  e->next = m_head.load(std::memory_order_relaxed);
+  m_head.store(e, std::memory_order_release);
+  return e;
+}
+
+// hint: remembers the name of a function global just pushed
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaCallStats::hint(lua_State* L, const char* name) {
+  if (lua_isfunction(L, -1)) {
+    m_hintptr = lua_topointer(L, -1);
+    m_hint    = name;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// LuaGCStats: garbage collector telemetry. Completed cycles are counted by a
+// finalizer that re-arms itself every cycle, so automatic collections count
+// too (in generational mode so do minor collections). Collector work the
+// wrapper runs itself (gcStep, gcIdle, gcCollect and the catch-up after a
+// LuaNoGCRegion) is timed into a pause histogram (ns). The steps lua runs
+// from inside allocations are not seen by the wrapper, so the histogram only
+// covers these explicit steps, not the automatic pauses.
+// Counters are relaxed atomics, snapshot() may run on any thread.
+////////////////////////////////////////////////////////////////////////////////
+
+class LuaGCStats {
+
+public:
+  struct Snapshot {
+    uint64_t cycles;   // completed collection cycles
+    uint64_t steps;    // timed steps
+    uint64_t collects; // timed full collections
+    uint64_t totalNs;  // time spent in timed steps and collections
+    uint64_t p50Ns;
+    uint64_t p99Ns;
+    uint64_t maxNs;    // lower bound of the highest bucket
+  };
+
+  LuaGCStats() : m_cycles(0), m_steps(0), m_collects(0), m_totalNs(0),
+                 m_closing(false) {}
+
+  LuaGCStats(const LuaGCStats&) = delete;
+  LuaGCStats& operator=(const LuaGCStats&) = delete;
+
+  uint64_t            cycles() const { return m_cycles.load(); }
+  const LuaHistogram& pauses() const { return m_pauses; }
+  Snapshot            snapshot() const;
+
+private:
+  friend class LuaWrapper;
+
+  void record(uint64_t ns, bool full) {
+    (full ? m_collects : m_steps).fetch_add(1, std::memory_order_relaxed);
+    m_totalNs.fetch_add(ns, std::memory_order_relaxed);
+    m_pauses.record(ns);
+  }
+
+  std::atomic<uint64_t> m_cycles;
+  std::atomic<uint64_t> m_steps;
+  std::atomic<uint64_t> m_collects;
+  std::atomic<uint64_t> m_totalNs;
+  LuaHistogram          m_pauses;
+  bool                  m_closing; // stops re-arming while the state closes
+};
+
+// snapshot: copies counters and pause percentiles
+////////////////////////////////////////////////////////////////////////////////
+inline LuaGCStats::Snapshot LuaGCStats::snapshot() const {
+  uint64_t counts[LuaHistogram::BUCKETS];
+  Snapshot snap;
+  snap.cycles   = m_cycles.load(std::memory_order_relaxed);
+  snap.steps    = m_steps.load(std::memory_order_relaxed);
+  snap.collects = m_collects.load(std::memory_order_relaxed);
+  snap.totalNs  = m_totalNs.load(std::memory_order_relaxed);
+  m_pauses.snapshot(counts);
+  snap.p50Ns = LuaHistogram::percentile(counts, 0.50);
+  snap.p99Ns = LuaHistogram::percentile(counts, 0.99);
+  snap.maxNs = 0;
+  for (int i = LuaHistogram::BUCKETS - 1; i >= 0; i--) {
+    if (counts[i]) {
+      snap.maxNs = LuaHistogram::lowerBound(i);
+      break;
+    }
+  }
+  return snap;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// LuaError: last error of a LuaWrapper call. The message handler only copies
+// the source locations of the failing stack ("Sl", no name lookup), the
+// traceback text is built the first time traceback() is called. Function
+// names are resolved then, by searching package.loaded for the function of
+// each frame like luaL_traceback does for global functions, so frames of
+// local functions show their definition instead. Valid until the next
+// failing call, and the state must still exist when traceback() is called.
+////////////////////////////////////////////////////////////////////////////////
+
+class LuaError {
+
+public:
+  enum { MAX_FRAMES = 16 };
+
+  LuaError() : m_code(LUA_OK), m_L(NULL), m_nframes(0), m_built(false) {}
+
+  LuaError(const LuaError&) = delete;
+  LuaError& operator=(const LuaError&) = delete;
+
+  // LUA_OK, LUA_ERRRUN, LUA_ERRSYNTAX, LUA_ERRMEM, LUA_ERRERR or LUA_ERRFILE
+  int                  code() const    { return m_code; }
+  bool                 failed() const  { return m_code != LUA_OK; }
+  const LuaStringView& message() const { return m_message; }
+  const std::string&   traceback() const;
+  void                 clear();
+
+private:
+  friend class LuaWrapper;
+
+  struct Frame {
+    char          source[LUA_IDSIZE];
+    char          what;        // 'L'ua, 'C', 'm'ain
+    int           currentline;
+    int           linedefined;
+    const void*   function;    // lua_topointer identity, to find its name
+  };
+
+  void capture(lua_State* L, int level); // copies frames from level up
+  bool globalName(const Frame& f, std::string& name) const;
+  static bool sameFunction(lua_State* L, int index, const Frame& f);
+
+  int                 m_code;
+  lua_State*          m_L;       // state to resolve function names in
+  LuaStringView       m_message;
+  Frame               m_frames[MAX_FRAMES];
+  int                 m_nframes;
+  mutable bool        m_built;
+  mutable std::string m_traceback;
+};
+
+// traceback: formats message and captured frames like luaL_traceback
+////////////////////////////////////////////////////////////////////////////////
+inline const std::string& LuaError::traceback() const {
+  if (m_built)
+    return m_traceback;
+
+  m_traceback = m_message.str();
+  m_traceback.append("\nstack traceback:");
+  char line[2 * LUA_IDSIZE + 64];
+  std::string name;
+  for (int i = 0; i < m_nframes; i++) {
+    const Frame& f = m_frames[i];
+    m_traceback.append("\n\t").append(f.source);
+    if (f.currentline > 0) {
+      snprintf(line, sizeof(line), ":%d", f.currentline);
+      m_traceback.append(line);
+    }
+    if (f.what == 'm')
+      m_traceback.append(": in main chunk");
+    else if (globalName(f, name))
+      m_traceback.append(": in function '").append(name).append("'");
+    else if (f.what == 'C')
+      m_traceback.append(": in ?");
+    else {
+      snprintf(line, sizeof(line), ": in function <%s:%d>",
+               f.source, f.linedefined);
+      m_traceback.append(line);
+    }
+  }
+  m_built = true;
+  return m_traceback;
+}
+
+// globalName: finds "module.field" (or just "field" for globals) holding the
+// function of frame f among the tables in package.loaded
+////////////////////////////////////////////////////////////////////////////////
+inline bool LuaError::globalName(const Frame& f, std::string& name) const {
+  lua_State* L = m_L;
+  if (!L || !lua_checkstack(L, 6))
+    return false;
+  int top = lua_gettop(L);
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+  if (!lua_istable(L, top + 1)) {
+    lua_settop(L, top);
+    return false;
+  }
+  lua_pushnil(L);
+  while (lua_next(L, top + 1)) {       // top + 2: module, top + 3: table
+    if (lua_type(L, top + 2) == LUA_TSTRING && lua_istable(L, top + 3)) {
+      lua_pushnil(L);
+      while (lua_next(L, top + 3)) {   // top + 4: field, top + 5: value
+        if (lua_type(L, top + 4) == LUA_TSTRING &&
+            sameFunction(L, top + 5, f)) {
+          const char* module = lua_tostring(L, top + 2);
+          name.clear();
+          if (strcmp(module, "_G") != 0)
+            name.append(module).append(".");
+          name.append(lua_tostring(L, top + 4));
+          lua_settop(L, top);
+          return true;
+        }
+        lua_pop(L, 1);
+      }
+    }
+    lua_pop(L, 1);
+  }
+  lua_settop(L, top);
+  return false;
+}
+
+// sameFunction: whether the value at index is the function of frame f, by
+// identity, so closures defined on one line are told apart. Frames do not
+// anchor their function; call traceback() before the failed one may be freed.
+////////////////////////////////////////////////////////////////////////////////
+inline bool LuaError::sameFunction(lua_State* L, int index, const Frame& f) {
+  return f.function && lua_isfunction(L, index) &&
+         lua_topointer(L, index) == f.function;
+}
+
+// clear: forgets the last error
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaError::clear() {
+  m_code    = LUA_OK;
+  m_L       = NULL;
+  m_message = LuaStringView();
+  m_nframes = 0;
+  m_built   = false;
+  m_traceback.clear();
+}
+
+// capture: copies source and lines of up to MAX_FRAMES stack levels, called
+// from the message handler while the failing stack still exists. Names are
+// left to traceback(), "n" would decode the calling instruction per frame.
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaError::capture(lua_State* L, int level) {
+  lua_Debug ar;
+  m_nframes = 0;
+  while (m_nframes < MAX_FRAMES && lua_getstack(L, level++, &ar)) {
+    lua_getinfo(L, "Slf", &ar);
+    Frame& f = m_frames[m_nframes++];
+    memcpy(f.source, ar.short_src, sizeof(f.source));
+    f.source[sizeof(f.source) - 1] = '\0';
+    f.function    = lua_topointer(L, -1);
+    lua_pop(L, 1);
+    f.what        = *ar.what;
+    f.currentline = ar.currentline;
+    f.linedefined = ar.linedefined;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// LuaStackGuard: records the stack top and restores it on scope exit. Given
+// an expected net push count the guard instead checks a call's stack effect:
+// debug builds assert that exactly "pushes" values were added (or removed,
+// if negative) before restoring to that level. Guards also track the deepest
+// stack they saw in the wrapper's state, reported by stackHighWater().
+// LUAWRAPPER_STACK_CHECK places a checking guard in wrapper calls and
+// compiles to nothing with NDEBUG. With lua built as C a lua error longjmps
+// past the guard's destructor, so guards stay out of functions that raise
+// errors themselves or run metamethods.
+////////////////////////////////////////////////////////////////////////////////
+
+class LuaStackGuard {
+
+public:
+  // restores the current top on exit
+  explicit LuaStackGuard(lua_State* L)
+  : m_L(L), m_top(lua_gettop(L)), m_check(false),
+    m_exceptions(uncaught()) { mark(L, m_top); }
+  // expects the top to be moved by pushes on exit
+  LuaStackGuard(lua_State* L, int pushes)
+  : m_L(L), m_top(lua_gettop(L) + pushes), m_check(true),
+    m_exceptions(uncaught()) { mark(L, m_top); }
+  ~LuaStackGuard();
+
+  LuaStackGuard(const LuaStackGuard&) = delete;
+  LuaStackGuard& operator=(const LuaStackGuard&) = delete;
+
+  int  top() const { return m_top; } // top restored on exit
+  void dismiss() { m_L = NULL; }     // keeps the stack as it is on exit
+
+private:
+  static int  uncaught();
+  static void mark(lua_State* L, int top);
+
+  lua_State* m_L;
+  int        m_top;
+  bool       m_check;
+  int        m_exceptions; // uncaught exceptions at construction
+};
+
+#ifdef NDEBUG
+#define LUAWRAPPER_STACK_CHECK(L, pushes)
+#else
+#define LUAWRAPPER_STACK_CHECK(L, pushes) \
+  LuaStackGuard luawrapper_stack_check((L), (pushes))
+#endif
+
+// Destructor - restores the top. Nothing is touched while an exception
+// thrown after construction unwinds, a lua error raised as exception still
+// needs its message on the stack.
+inline LuaStackGuard::~LuaStackGuard() {
+  if (!m_L || uncaught() > m_exceptions)
+    return;
+  int top = lua_gettop(m_L);
+  mark(m_L, top);
+  assert((!m_check || top == m_top) && "unbalanced lua stack");
+  if (top != m_top)
+    lua_settop(m_L, m_top);
+}
+
+// uncaught: exceptions in flight, before C++17 only whether there is one
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaStackGuard::uncaught() {
+#if __cplusplus >= 201703L
+  return std::uncaught_exceptions();
+#else
+  return std::uncaught_exception() ? 1 : 0;
+#endif
+}
+
+class LuaWrapper {
+
+public:
+  // @brief accesses the singleton object.
+  static LuaWrapper& instance();
+
+
+  // @brief default constructor, creates and initializes an independent state.
+  LuaWrapper();
+
+  // @brief destructor.
+  virtual ~LuaWrapper();
+
+  // @brief creates the state with lua_newstate routing every allocation
+  // through allocf, see LuaPoolAllocator and LuaArenaAllocator. The allocator
+  // data ud must outlive the wrapper.
+  LuaWrapper(lua_Alloc allocf, void* ud);
+
+  // @brief creates an independent state limited to memlimit bytes, see
+  // setMemoryLimit.
+  explicit LuaWrapper(size_t memlimit);
+
+  LuaWrapper(const LuaWrapper&) = delete;
+  LuaWrapper& operator=(const LuaWrapper&) = delete;
+
+
+  // Returns lua state, CAREFUL NOT TO MANAGE WHAT SHOULD BE MANAGED BY THE
+  // LUAWRAPPER LIBRARY!
+  lua_State* getLuaState();
+
+  // wraps lua API for current lua state
+  //////////////////////////////////////////////////////////////////////////////
+  void getGlobal( const char* name );
+  void setGlobal( const char* name );
+  // doFile and callFunction report failures through lastError() and leave
+  // no error message on the stack
+  int  doFile( const char* filename );
+  int  doFileCached( const char* filename ); // doFile through bytecode cache
+  // Loads source or bytecode in buffer with one lua_load read and no copy,
+  // name is the chunk name for error messages ("@file" or "=name"). Runs
+  // the chunk like doFile, or leaves it on the stack if run is false.
+  int  loadBuffer( const char* buffer, size_t size, const char* name,
+                   bool run = true );
+  // loadBuffer over the file mapped into memory (read on windows)
+  int  doFileMapped( const char* filename, bool run = true );
+  // Runs module name of bundle like doFileMapped, without copying it
+  int  doBundle( const LuaBundle& bundle, const char* name, bool run = true );
+  // Requires module name from bundle: pushes the result of require(name)
+  // with bundle searched first among the bundles meanwhile, so the modules
+  // it requires come from it too. Returns 0, or 1 with lastError().
+  int  requireBundle( const LuaBundle& bundle, const char* name );
+  void setBytecodeCache( LuaBytecodeCache* cache );
+  int  callFunction( int nargs, int nresults );
+  // callFunction bounded by budget, a call aborted for exceeding it fails
+  // with CALL_ERROR and lastAbort() telling why
+  int  callFunction( int nargs, int nresults, const LuaBudget& budget );
+  const LuaError& lastError() const { return m_lasterror; }
+  // CALL_DEADLINE or CALL_BUDGET if lastError() is a budget abort, else CALL_OK
+  int  lastAbort() const { return m_lastabort; }
+  // f is a lua_CFunction cast to void(*)(void), as with earlier versions; a
+  // real void() function must be bound through a lambda
+  void registerFunc( const char* funcname, void (*f)(void) );
+  void registerFunc( const char* funcname, lua_CFunction f );
+  // Binds any C++ function: arguments are converted from the lua stack and
+  // return values pushed back, std::tuple results become multiple returns
+  template <class R, class... Args>
+  void registerFunc( const char* funcname, R (*f)(Args...) );
+  // Binds lambdas and functors, the callable is copied into the closure
+  template <class F>
+  typename std::enable_if<
+    std::is_class<typename std::decay<F>::type>::value>::type
+  registerFunc( const char* funcname, F&& f );
+  // Binds obj->method, obj must outlive the state or the registration
+  template <class T, class M>
+  void registerMethod( const char* funcname, T* obj, M method );
+  int  doesFuncExist(char* luafuncname);
+
+  // Modules for require, resolved by a searcher placed ahead of the default
+  // ones with one hash lookup and no file system access. A module is a
+  // source or bytecode chunk (copied) or an opener like luaopen_commands.
+  // Registered bundles are searched next, in order, and must outlive the
+  // state or be unregistered.
+  void registerModule( const char* name, const char* chunk, size_t size );
+  void registerModule( const char* name, lua_CFunction opener );
+  void unregisterModule( const char* name );
+  void registerBundle( const LuaBundle* bundle );
+  void unregisterBundle( const LuaBundle* bundle );
+
+  // Calls global lua function "name" with args and reads its results as R,
+  // which may be void, a single type or a std::tuple of types for multiple
+  // returns, e.g. call<std::tuple<int,double>>("fn", 1, "x", 2.5). On errors
+  // a default R is returned and lastError() describes the error.
+  template <class R, class... Args>
+  R call( const char* name, Args&&... args );
+
+  // Resolves global function "name" once and pins it in the registry, the
+  // returned handle calls it without looking the name up again. The handle is
+  // invalid if the global is not a function.
+  LuaFunction getFunction( const char* name );
+
+  // stack manipulation functions
+  //////////////////////////////////////////////////////////////////////////////
+  void        pushNumber( double n );
+  void        pushInt( int n );
+  void        pushString( const char* s );
+  void        pushNil();
+  void        pushLUserdata( void* p );
+  void        pop(){ lua_pop( m_luastate, 1 );}
+  int         popInt();
+  double      popNumber();
+  const char* popString();
+  LuaStringView popStringView(); // pops string keeping it alive in the view
+  void*       popUserdata(); // Warning: Careful to use type casting correctly!
+  void        moveToTop(int index);
+  int         isNil( int index ); // query if index value is nil
+  void        createTable(); // Creates table and places on top os stack
+  // While setting/getting table values table must be at the top of the stack.
+  void        pushTableValue(char* key); // Pushes key contents to stack
+  void        pushTableValue(int index); // Pushes index contents to stack
+  // Reads string field of table at top of stack, leaving only the table
+  LuaStringView getTableStringView(const char* key);
+  LuaStringView getTableStringView(int index);
+  // Struct marshalling through a LuaStruct<T> descriptor: pushStruct pushes a
+  // new table with all fields, readStruct fills fields present in the table at
+  // stack index and leaves missing ones untouched.
+  template <class T> void pushStruct(const T& s);
+  template <class T> void readStruct(int index, T& s);
+  void        setTable(); // to use setTable first push key and value to stack
+  // Bulk array transfer: pushArray creates a presized array table with the
+  // values, readArray copies up to n elements of the array at stack index
+  // into values and returns the number of elements copied.
+  void        pushArray(const double* values, size_t n);
+  void        pushArray(const std::vector<double>& values);
+  size_t      readArray(int index, double* values, size_t n);
+  size_t      readArray(int index, std::vector<double>& values);
+  int         pop2Ref();
+  void        pushRef(int refval);
+  LuaRef      pop2LuaRef(); // persistent reference, see LuaRef
+
+  void        stackDump();   // Dumps CtoLua stack information for debugging
+
+  // sampling profiler, can be started and stopped on a live state from any
+  // thread, see LuaProfiler
+  void         startProfiler(int period = LuaProfiler::DEFAULT_PERIOD);
+  void         stopProfiler();
+  LuaProfiler& profiler() { return m_profiler; }
+
+  // opt-in per-function call statistics, snapshots are thread safe
+  void          enableCallStats(bool enabled);
+  LuaCallStats& callStats() { return m_callstats; }
+
+  // garbage collector control, see also LuaNoGCRegion
+  enum gcMode {
+    GC_INCREMENTAL,
+    GC_GENERATIONAL // lua 5.4 and later
+  };
+  // Switches collector mode, generational mode takes the minor and major
+  // multipliers. Zero parameters keep their values, returns false if the
+  // mode is not available.
+  bool        setGCMode(gcMode mode, int minormul = 0, int majormul = 0);
+  // incremental pause and step multiplier in percent, zero keeps the value
+  void        setGCTuning(int pause, int stepmul);
+  // Explicit collector work, which does nothing inside a LuaNoGCRegion (lua
+  // would step even a stopped collector).
+  bool        gcStep();    // one basic step, true if it ended a cycle
+  // Runs basic steps for at most budget, e.g. while waiting for requests.
+  // Returns true if a cycle was completed.
+  bool        gcIdle(std::chrono::nanoseconds budget);
+  void        gcCollect(); // full collection
+  size_t      gcBytes();   // memory in use by the state
+  LuaGCStats& gcStats() { return m_gcstats; }
+
+  // Limits the memory of the state to limit bytes, 0 lifts the limit. An
+  // allocation over the limit fails once lua's emergency full collection
+  // could not make room, and the call fails with
+  // lastError().code() == LUA_ERRMEM. The limit is enforced by an allocator
+  // wrapped around the state's own when first set.
+  // Only allocations inside protected calls fail gracefully. Wrapper calls
+  // made outside one (pushString, createTable, pop2Ref, pop2LuaRef, ...)
+  // raise the memory error unprotected and lua panics and aborts, so leave
+  // headroom for the host's own pushes or lift the limit around them.
+  void        setMemoryLimit(size_t limit);
+  size_t      memoryLimit() const { return m_memlimit; }
+  size_t      memoryUsed() const  { return m_memused; } // once limited
+
+  // Request isolation for a reused state: saveBaseline records globals,
+  // the registry's named entries, package.loaded and the fields of every
+  // loaded package table, e.g. once scripts are loaded. reset() then drops
+  // keys added since, restores replaced or removed ones and metatables, and
+  // empties the stack. It is shallow: a request that sets a field of a
+  // nested table (config.limits.max = 0) or assigns an upvalue of a global
+  // function (a module's local counter) leaves that change in place for the
+  // next request. The wrapper's own registry entries (lightuserdata keys:
+  // LuaClass metatables, struct key caches, ...) are not tracked and survive
+  // reset(), but globals such as a LuaClass methods table are dropped if
+  // created after the baseline, so register first. The garbage the request
+  // left is collected as usual, or within gcBudget right away (see gcIdle).
+  // reset() returns false if no baseline was saved; it must not run inside
+  // a LuaNoGCRegion, a budgeted call or while the profiler runs.
+  void        saveBaseline();
+  bool        reset(std::chrono::nanoseconds gcBudget =
+                      std::chrono::nanoseconds::zero());
+
+  FILE* LuaWrapperOpenFile ( char* fname, char* stats );
+  void  LuaWrapperCloseFile( FILE* fp );
+
+  enum luaType {
+    TNIL       = LUA_TNIL,
+    TBOOL      = LUA_TBOOLEAN,
+    TLUSERDATA = LUA_TLIGHTUSERDATA,
+    TNUMBER    = LUA_TNUMBER,
+    TSTRING    = LUA_TSTRING,
+    TTABLE     = LUA_TTABLE,
+    TFUNCTION  = LUA_TFUNCTION,
+    TUSERDATA  = LUA_TUSERDATA,
+    TTHREAD    = LUA_TTHREAD
+  };
+
+  struct luaObj {
+    void* value;
+    luaType type;
+  };
+
+  // callFunction results
+  enum callStatus {
+    CALL_ERROR    = 0,
+    CALL_OK       = 1,
+    CALL_DEADLINE = 2, // lastAbort(): aborted at the budget deadline
+    CALL_BUDGET   = 3  // lastAbort(): aborted after the budget instructions
+  };
+
+  // wrapper owning lua state L (or a thread of it)
+  static LuaWrapper* fromState(lua_State* L);
+
+  // deepest stack seen by a LuaStackGuard in this state, 0 with NDEBUG
+  int         stackHighWater() const { return m_stackhigh; }
+  void        resetStackHighWater()  { m_stackhigh = 0; }
+
+private:
+  friend class LuaFunction;
+  friend class LuaScheduler;
+  friend class LuaNoGCRegion;
+  friend class LuaStackGuard;
+
+  // active callFunction budget, checked by budgetHook
+  struct BudgetState {
+    LuaBudget::clock::time_point deadline;
+    long long                    left;   // instructions left, if counted
+    int                          step;   // hook granularity
+    bool                         timed;
+    bool                         counted;
+    int                          tripped; // callStatus that aborted the call
+  };
+
+  // opens libs and commands on a freshly created state
+  void init();
+  static int panic(lua_State* L);
+  // count hook shared by budgets and the profiler
+  static void countHook(lua_State* L, lua_Debug* ar);
+  int  hookStep() const;
+  void updateHook(lua_State* L);
+  void armThread(lua_State* co);
+  // coroutine.resume and coroutine.wrap arming the thread they resume
+  void hookCoroutines();
+  static int coResume(lua_State* L);
+  static int coWrap(lua_State* L);
+  static int coWrapped(lua_State* L);
+
+  // cycle counting finalizer, see LuaGCStats
+  static int gcSentinel(lua_State* L);
+  void armGCSentinel();
+  // LuaNoGCRegion entry and exit
+  void stopGC();
+  void restartGC();
+  // registered module, chunk is used if opener is NULL
+  struct Module {
+    std::string   chunk;
+    lua_CFunction opener;
+  };
+  // package.searchers entry for registered modules and bundles
+  static int moduleSearcher(lua_State* L);
+  void installSearcher();
+
+  // registry key of the saved baseline
+  static const void* baselineKey() {
+    static const char key = 0;
+    return &key;
+  }
+  // baseline helpers, tables are given by absolute stack index
+  void trackTable(int list, int seen, int table);
+  void restoreTable(int table, int copy, int count, bool named);
+
+  // allocator enforcing m_memlimit, ud is the wrapper
+  static void* limitAlloc(void* ud, void* ptr, size_t osize, size_t nsize);
+
+  // lua_pcall through messageHandler, errors are moved to lastError
+  int  protectedCall(int nargs, int nresults);
+  static int messageHandler(lua_State* L);
+  // moves the error message on top of stack into err
+  void popError(LuaError& err, int code);
+  // moves the error of a failed coroutine co into err
+  void threadError(LuaError& err, lua_State* co, int code);
+  static uint64_t elapsedNs(LuaBudget::clock::time_point start) {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+      LuaBudget::clock::now() - start).count();
+  }
+
+  // calls the function already on top of stack with args, see call
+  template <class R, class... Args>
+  R callPushed( Args&&... args );
+
+  // pointer to the SINGLETON object of this class
+  static LuaWrapper* m_LuaWrapper;
+  // Lua Variables
+  lua_State*        m_luastate;
+  char*             m_status;
+  LuaRefSlab        m_refslab;
+  LuaBytecodeCache* m_bccache;
+  BudgetState       m_budget;
+  LuaProfiler       m_profiler;
+  LuaCallStats      m_callstats;
+  LuaError          m_lasterror;
+  int               m_lastabort; // see lastAbort
+  LuaGCStats        m_gcstats;
+  int               m_nogc;     // open LuaNoGCRegions
+  bool              m_gcwasrunning; // collector state before the regions
+  lua_Alloc         m_allocf;   // wrapped allocator, NULL until limited
+  void*             m_allocud;
+  size_t            m_memlimit; // bytes, 0 for no limit
+  size_t            m_memused;  // bytes allocated through limitAlloc
+  std::unordered_map<std::string, Module> m_modules;
+  std::vector<const LuaBundle*>           m_bundles;
+  bool              m_searcher; // moduleSearcher installed
+  int               m_stackhigh; // see stackHighWater
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// LuaFunction: handle to a lua function pinned in the registry of the state
+// that created it, must not outlive that LuaWrapper
+////////////////////////////////////////////////////////////////////////////////
+
+class LuaFunction {
+
+public:
+  LuaFunction() : m_wrapper(NULL) {}
+  LuaFunction(LuaFunction&& other)
+  : m_wrapper(other.m_wrapper), m_ref(std::move(other.m_ref)) {
+    other.m_wrapper = NULL;
+  }
+  LuaFunction& operator=(LuaFunction&& other) {
+    if (this != &other) {
+      m_wrapper = other.m_wrapper;
+      m_ref     = std::move(other.m_ref);
+      other.m_wrapper = NULL;
+    }
+    return *this;
+  }
+
+  LuaFunction(const LuaFunction&) = delete;
+  LuaFunction& operator=(const LuaFunction&) = delete;
+
+  bool isValid() const { return m_wrapper && m_ref.isValid(); }
+
+  // pushes the function to the stack, the handle stays valid. An invalid
+  // handle of a state pushes nil.
+  void push() const {
+    assert(m_wrapper && "push of a default constructed LuaFunction");
+    if (m_ref.isValid())
+      m_ref.push();
+    else
+      lua_pushnil(m_wrapper->getLuaState());
+  }
+
+  // calls the function with args and reads results as in LuaWrapper::call.
+  // An invalid handle fails like a missing global: R() with lastError() set,
+  // or only R() for a default constructed handle, which has no state.
+  template <class R, class... Args>
+  R call( Args&&... args ) const {
+    if (!m_wrapper)
+      return R();
+    push();
+    return m_wrapper->callPushed<R>(std::forward<Args>(args)...);
+  }
+
+  // unpins the function, the handle becomes invalid
+  void release() {
+    m_ref.release();
+  }
+
+private:
+  friend class LuaWrapper;
+  LuaFunction(LuaWrapper* wrapper, LuaRef&& ref)
+  : m_wrapper(wrapper), m_ref(std::move(ref)) {}
+
+  LuaWrapper* m_wrapper;
+  LuaRef      m_ref;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Constructor - (bad) Constructor does work to have a global initialization of
+// the lua state by the singleton object
+inline LuaWrapper::LuaWrapper()
+: m_luastate(NULL), // initialize lua state as null
+  m_status(NULL),   // initialize status as null
+  m_bccache(&LuaBytecodeCache::global())
+{
+  m_luastate = luaL_newstate();   /* opens Lua */
+  init();
+}
+
+// Constructor - same as the default constructor with a custom allocator
+inline LuaWrapper::LuaWrapper(lua_Alloc allocf, void* ud)
+: m_luastate(NULL),
+  m_status(NULL),
+  m_bccache(&LuaBytecodeCache::global())
+{
+  m_luastate = lua_newstate(allocf, ud);
+  lua_atpanic(m_luastate, &LuaWrapper::panic); // as set by luaL_newstate
+  init();
+}
+
+// Constructor - same as the default constructor with a memory limit, the
+// limit applies after the libraries are opened
+inline LuaWrapper::LuaWrapper(size_t memlimit)
+: m_luastate(NULL),
+  m_status(NULL),
+  m_bccache(&LuaBytecodeCache::global())
+{
+  m_luastate = luaL_newstate();
+  init();
+  setMemoryLimit(memlimit);
+}
+
+// init: common state initialization for all constructors
+inline void LuaWrapper::init() {
+  m_budget   = BudgetState();
+  m_lastabort = CALL_OK;
+  m_nogc     = 0;
+  m_gcwasrunning = true;
+  m_allocf   = NULL;
+  m_allocud  = NULL;
+  m_memlimit = 0;
+  m_memused  = 0;
+  m_searcher = false;
+  m_stackhigh = 0;
+  *(LuaWrapper**)lua_getextraspace(m_luastate) = this;
+  luaL_openlibs(m_luastate);      /* auxiliary Lua libs. */
+  hookCoroutines();
+  luaopen_commands(m_luastate);
+  m_refslab.setLuaState(m_luastate);
+  armGCSentinel();
+}
+
+// panic: reports unprotected errors before lua aborts
+inline int LuaWrapper::panic(lua_State* L) {
+  const char* msg = lua_tostring(L, -1);
+  fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+          msg ? msg : "error object is not a string");
+  return 0;
+}
+
+// fromState: finds the wrapper of a state, threads share the extra space of
+// the main state they were created from
+inline LuaWrapper* LuaWrapper::fromState(lua_State* L) {
+  return *(LuaWrapper**)lua_getextraspace(L);
+}
+
+// Destructor - finalizes lua state and clears the singleton pointer if this is
+// the singleton object
+inline LuaWrapper::~LuaWrapper() {
+  m_lasterror.clear(); // releases its registry slot while the state is open
+  m_gcstats.m_closing = true;
+  if(m_luastate)
+    lua_close(m_luastate);
+  free(m_status);
+  if (m_LuaWrapper == this)
+    m_LuaWrapper = NULL;
+}
+
+// Singleton instance access method
+////////////////////////////////////////////////////////////////////////////////
+inline LuaWrapper& LuaWrapper::instance() {
+  return m_LuaWrapper ? *m_LuaWrapper : *(m_LuaWrapper = new LuaWrapper());
+}
+
+// getLuaState: Return lua state, not to be used to handle lua state itself,
+// which should be done internally by THIS library!
+////////////////////////////////////////////////////////////////////////////////
+inline lua_State* LuaWrapper::getLuaState() {
+  return m_luastate;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Stack Manipulation Functions
+////////////////////////////////////////////////////////////////////////////////
+
+// pushNumber: pushes a number to lua stack
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::pushNumber(double n) {
+  lua_pushnumber(m_luastate, n);
+}
+
+// pushInt: pushes an integer to lua stack
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::pushInt(int n) {
+  lua_pushinteger(m_luastate, n);
+}
+
+// pushString: pushes a c format string to lua stack
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::pushString(const char* s) {
+  lua_pushstring(m_luastate, s);
+}
+
+// pushNil: pushes nil (lua NULL type)
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::pushNil() {
+  lua_pushnil(m_luastate);
+}
+
+// pushUserdata: Pushed a generic (light/no GC) userdata type to stack
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::pushLUserdata(void* p) {
+  lua_pushlightuserdata(m_luastate, p);
+}
+
+// popInt: Pops an integer from the stack
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaWrapper::popInt() {
+  if (!lua_isnumber(m_luastate, -1))
+  {
+    luaL_error(m_luastate,
+               "ERROR: C-Lua stack value type mismatch (should be a number)!");
+  }
+  int n = lua_tointeger(m_luastate, -1);
+  lua_pop(m_luastate, 1);
+
+  return n;
+}
+
+// popNumber: Pops a double from the stack
+////////////////////////////////////////////////////////////////////////////////
+inline double LuaWrapper::popNumber() {
+  if (!lua_isnumber(m_luastate, -1)) {
+    luaL_error(m_luastate,
+               "ERROR: C-Lua stack value type mismatch (should be a number)!");
+  }
+
+  double num = lua_tonumber (m_luastate, -1);
+  lua_pop(m_luastate, 1);
+
+  return num;
+}
+
+// popString: Pops a string from the stack
+////////////////////////////////////////////////////////////////////////////////
+inline const char*
+LuaWrapper::popString() {
+  if (!lua_isstring(m_luastate, -1)) {
+    luaL_error(m_luastate,
+               "ERROR: C-Lua stack value type mismatch (should be a string)!");
+  }
+
+  const char* string = lua_tostring(m_luastate, -1);
+  lua_pop(m_luastate, 1);
+
+  return string;
+}
+
+// popStringView: Pops a string from the stack as a view anchored in the
+// registry, the pointer stays valid as long as the view exists
+////////////////////////////////////////////////////////////////////////////////
+inline LuaStringView LuaWrapper::popStringView() {
+  if (!lua_isstring(m_luastate, -1)) {
+    luaL_error(m_luastate,
+               "ERROR: C-Lua stack value type mismatch (should be a string)!");
+  }
+
+  LuaStringView view;
+  view.m_data   = lua_tolstring(m_luastate, -1, &view.m_size);
+  view.m_anchor = pop2LuaRef();
+
+  return view;
+}
+
+// popUserdata: Pops userdata generic lua type from the stack, extra care must
+// by taken when type casting
+////////////////////////////////////////////////////////////////////////////////
+inline void*
+LuaWrapper::popUserdata() {
+  if (!lua_isuserdata(m_luastate, -1)) {
+    luaL_error(m_luastate,
+               "ERROR: C-Lua stack value type mismatch (should be userdata)!");
+  }
+
+  void* vp = lua_touserdata(m_luastate, -1);
+  lua_pop(m_luastate, 1);
+
+  return vp;
+}
+
+// moveToTop: Moves stack index to top of stack (-1 index)
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::moveToTop(int index) {
+  lua_settop(m_luastate, index);
+}
+
+// isNil: Queries stack at "index" if entry is nil
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaWrapper::isNil( int index ) {
+  int ret = lua_isnil( m_luastate, index );
+  return ret;
+}
+
+// createTable: Creates a lua table and places it on top of stack
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::createTable() {
+  lua_newtable(m_luastate);
+}
+
+// pushTableValue: Gets field from table at top of stack and pushes value to
+// top of the stack
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::pushTableValue(int index) {
+  if (!lua_istable(m_luastate, -1))
+    luaL_error(m_luastate,
+      "ERROR: Trying to get table value without table at top of stack!");
+  lua_pushinteger(m_luastate, index);
+  lua_gettable(m_luastate, -2);
+}
+
+// pushTableValue: Gets field from table at top of stack and pushes value to
+// top of the stack
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::pushTableValue(char* key) {
+  if (!lua_istable(m_luastate, -1))
+    luaL_error(m_luastate,
+      "ERROR: Trying to get table value without table at top of stack!");
+  lua_pushstring(m_luastate, key);
+  lua_gettable(m_luastate, -2);
+}
+
+// getTableStringView: Gets string field from table at top of stack as an
+// anchored view without copying it
+////////////////////////////////////////////////////////////////////////////////
+inline LuaStringView LuaWrapper::getTableStringView(const char* key) {
+  if (!lua_istable(m_luastate, -1))
+    luaL_error(m_luastate,
+      "ERROR: Trying to get table value without table at top of stack!");
+  lua_getfield(m_luastate, -1, key);
+  return popStringView();
+}
+
+// getTableStringView: Gets string at index from table at top of stack as an
+// anchored view without copying it
+////////////////////////////////////////////////////////////////////////////////
+inline LuaStringView LuaWrapper::getTableStringView(int index) {
+  if (!lua_istable(m_luastate, -1))
+    luaL_error(m_luastate,
+      "ERROR: Trying to get table value without table at top of stack!");
+  lua_pushinteger(m_luastate, index);
+  lua_gettable(m_luastate, -2);
+  return popStringView();
+}
+
+// setTable: Same functioning as lua api. with table on top of stack first push
+// key then value, and finally call setTable to set lua table values.
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::setTable() {
+  if (!lua_istable(m_luastate, -3))
+    luaL_error(m_luastate,
+      "ERROR: Trying to set table without pushing key and value to stack!");
+  lua_settable(m_luastate, -3);
+}
+
+// pushArray: Creates a table presized for n elements and fills it with raw
+// sets, one lua_rawseti per element
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::pushArray(const double* values, size_t n) {
+  LUAWRAPPER_STACK_CHECK(m_luastate, 1);
+  lua_createtable(m_luastate, (int)n, 0);
+  for (size_t i = 0; i < n; i++) {
+    lua_pushnumber(m_luastate, values[i]);
+    lua_rawseti(m_luastate, -2, (lua_Integer)(i + 1));
+  }
+}
+
+// pushArray: Pushes vector contents as a lua array
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::pushArray(const std::vector<double>& values) {
+  pushArray(values.empty() ? NULL : &values[0], values.size());
+}
+
+// readArray: Copies up to n elements of the array table at index into values
+// with raw gets, returns the number of elements copied
+////////////////////////////////////////////////////////////////////////////////
+inline size_t LuaWrapper::readArray(int index, double* values, size_t n) {
+  if (!lua_istable(m_luastate, index))
+    luaL_error(m_luastate,
+      "ERROR: C-Lua stack value type mismatch (should be a table)!");
+  index = lua_absindex(m_luastate, index);
+
+  size_t len = (size_t)lua_rawlen(m_luastate, index);
+  if (len < n)
+    n = len;
+  for (size_t i = 0; i < n; i++) {
+    lua_rawgeti(m_luastate, index, (lua_Integer)(i + 1));
+    values[i] = lua_tonumber(m_luastate, -1);
+    lua_pop(m_luastate, 1);
+  }
+  return n;
+}
+
+// readArray: Replaces vector contents with the array table at index
+////////////////////////////////////////////////////////////////////////////////
+inline size_t LuaWrapper::readArray(int index, std::vector<double>& values) {
+  if (!lua_istable(m_luastate, index))
+    luaL_error(m_luastate,
+      "ERROR: C-Lua stack value type mismatch (should be a table)!");
+  values.resize((size_t)lua_rawlen(m_luastate, index));
+  return readArray(index, values.empty() ? NULL : &values[0], values.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// C-Lua API Functions
+////////////////////////////////////////////////////////////////////////////////
+
+// getGlobal: gets global namespace lua variable with stack. Used to access lua
+// variables from C
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::getGlobal(const char* name) {
+  lua_getglobal(m_luastate, name);
+  if (m_callstats.enabled())
+    m_callstats.hint(m_luastate, name);
+}
+
+// setglobal: sets global namespace lua variable with stack. Used to set lua
+// variables from C
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::setGlobal(const char* name) {
+  lua_setglobal(m_luastate, name);
+}
+
+// dofile: executes lua file, returns 0 if there are no errors or 1 in case of
+// errors, which are described by lastError().
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaWrapper::doFile(const char* filename) {
+  LuaCallStats::Entry* stats = NULL;
+  LuaBudget::clock::time_point start;
+  if (m_callstats.enabled()) {
+    stats = m_callstats.entryFor(filename);
+    start = LuaBudget::clock::now();
+  }
+  int ret = luaL_loadfile(m_luastate, filename);
+  if (ret == 0)
+    ret = protectedCall(0, LUA_MULTRET);
+  else
+    popError(m_lasterror, ret);
+  if (stats)
+    stats->record(elapsedNs(start), ret != 0);
+  return ret == 0 ? 0 : 1;
+}
+
+namespace luawrapper_detail {
+
+// dumpWriter: lua_Writer appending dumped chunks to a std::string
+inline int dumpWriter(lua_State*, const void* p, size_t sz, void* ud) {
+  ((std::string*)ud)->append((const char*)p, sz);
+  return 0;
+}
+
+// mtimeNs: modification time in nanoseconds where the platform has them, so
+// rewrites within one second still change the stamp
+inline int64_t mtimeNs(const struct stat& st) {
+#if defined(__APPLE__)
+  int64_t ns = (int64_t)st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+  int64_t ns = 0;
+#else
+  int64_t ns = (int64_t)st.st_mtim.tv_nsec;
+#endif
+  return (int64_t)st.st_mtime * 1000000000 + ns;
+}
+
+// Chunk: buffer handed out by chunkReader in a single read
+struct Chunk {
+  const char* data;
+  size_t      size;
+};
+
+// chunkReader: lua_Reader returning the whole buffer, then end of input
+inline const char* chunkReader(lua_State*, void* ud, size_t* size) {
+  Chunk* chunk = (Chunk*)ud;
+  *size = chunk->size;
+  chunk->size = 0;
+  return *size ? chunk->data : NULL;
+}
+
+} // namespace luawrapper_detail
+
+// loadBuffer: loads the chunk in buffer and runs it unless run is false,
+// returns 0 if there are no errors or 1 with lastError() set
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaWrapper::loadBuffer(const char* buffer, size_t size,
+                                  const char* name, bool run) {
+  luawrapper_detail::Chunk chunk = { buffer, size };
+  int ret = lua_load(m_luastate, luawrapper_detail::chunkReader, &chunk,
+                     name, NULL);
+  if (ret != 0)
+    popError(m_lasterror, ret);
+  else if (run)
+    ret = protectedCall(0, LUA_MULTRET);
+  return ret == 0 ? 0 : 1;
+}
+
+// doFileMapped: loads the file through loadBuffer straight from the page
+// cache, skipping a UTF-8 BOM and a first line starting with '#' as
+// luaL_loadfile does. The mapping is released before the chunk runs.
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaWrapper::doFileMapped(const char* filename, bool run) {
+  LuaCallStats::Entry* stats = NULL;
+  LuaBudget::clock::time_point start;
+  if (m_callstats.enabled()) {
+    stats = m_callstats.entryFor(filename);
+    start = LuaBudget::clock::now();
+  }
+
+  const char* data = NULL;
+  size_t      size = 0;
+#ifdef _WIN32
+  std::string contents;
+  FILE* fp = fopen(filename, "rb");
+  if (fp) {
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+      contents.append(buf, n);
+    fclose(fp);
+    data = contents.data();
+    size = contents.size();
+  }
+  bool opened = fp != NULL;
+#else
+  void* map = MAP_FAILED;
+  int   fd  = open(filename, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  bool opened = fd >= 0 && fstat(fd, &st) == 0;
+  if (opened && st.st_size > 0) {
+    size = (size_t)st.st_size;
+    map  = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    opened = map != MAP_FAILED;
+    if (opened) {
+      madvise(map, size, MADV_SEQUENTIAL);
+      data = (const char*)map;
+    }
+  }
+  if (fd >= 0)
+    close(fd);
+#endif
+  if (!opened) {
+    lua_pushfstring(m_luastate, "cannot open %s: %s", filename,
+                    strerror(errno));
+    popError(m_lasterror, LUA_ERRFILE);
+    if (stats)
+      stats->record(elapsedNs(start), true);
+    return 1;
+  }
+
+  const char* chunk = data;
+  const char* end   = data + size;
+  if (end - chunk >= 3 && !memcmp(chunk, "\xEF\xBB\xBF", 3))
+    chunk += 3;
+  if (chunk < end && *chunk == '#') {
+    while (chunk < end && *chunk != '\n')
+      chunk++; // keeps the newline so line numbers stay right
+  }
+
+  std::string name = std::string("@") + filename;
+  int ret = loadBuffer(chunk, (size_t)(end - chunk), name.c_str(), false);
+#ifndef _WIN32
+  if (map != MAP_FAILED)
+    munmap(map, size);
+#endif
+  if (ret == 0 && run)
+    ret = protectedCall(0, LUA_MULTRET) == 0 ? 0 : 1;
+  if (stats)
+    stats->record(elapsedNs(start), ret != 0);
+  return ret;
+}
+
+// doBundle: loads module name straight from the bundle mapping
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaWrapper::doBundle(const LuaBundle& bundle, const char* name,
+                                bool run) {
+  const char* data;
+  size_t      size;
+  if (!bundle.find(name, data, size)) {
+    lua_pushfstring(m_luastate, "module '%s' not found in bundle", name);
+    popError(m_lasterror, LUA_ERRFILE);
+    return 1;
+  }
+  std::string chunkname = std::string("@") + name;
+  return loadBuffer(data, size, chunkname.c_str(), run);
+}
+
+// requireBundle: calls require through moduleSearcher with bundle
+// registered first for the call, so the module and its own requires load
+// like any registered bundle and get the loader data argument
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaWrapper::requireBundle(const LuaBundle& bundle,
+                                     const char* name) {
+  installSearcher();
+  lua_getglobal(m_luastate, "require");
+  if (!m_searcher || !lua_isfunction(m_luastate, -1)) {
+    lua_pop(m_luastate, 1);
+    lua_pushfstring(m_luastate, "cannot require '%s': no package library",
+                    name);
+    popError(m_lasterror, LUA_ERRRUN);
+    return 1;
+  }
 
-// macro to call the singleton LuaWrapper
-#define luaWrap LuaWrapper::instance()
+  m_bundles.insert(m_bundles.begin(), &bundle); // first, even if registered
+  lua_pushstring(m_luastate, name);
+  int ret = protectedCall(1, 1);
+  std::vector<const LuaBundle*>::iterator it =
+    std::find(m_bundles.begin(), m_bundles.end(), &bundle);
+  if (it != m_bundles.end())
+    m_bundles.erase(it);
+  return ret == 0 ? 0 : 1;
+}
 
-extern int luaopen_commands (lua_State* tolua_S);
+// doFileCached: same as doFile, but loads the chunk from bytecode cached for
+// the file's path, mtime and size, compiling and caching it on misses
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaWrapper::doFileCached(const char* filename) {
+  struct stat st;
+  if (stat(filename, &st) != 0)
+    return doFile(filename);
 
-class LuaWrapper {
+  LuaCallStats::Entry* stats = NULL;
+  LuaBudget::clock::time_point start;
+  if (m_callstats.enabled()) {
+    stats = m_callstats.entryFor(filename);
+    start = LuaBudget::clock::now();
+  }
 
-public:
-  // @brief accesses the singleton object.
-  static LuaWrapper& instance();
+  std::string path(filename);
+  std::string chunkname = "@" + path;
+  int64_t mtime = luawrapper_detail::mtimeNs(st);
+  LuaBytecodeCache::Chunk chunk =
+    m_bccache->find(path, mtime, (int64_t)st.st_size);
 
+  int ret = 1;
+  if (chunk) {
+    ret = luaL_loadbufferx(m_luastate, chunk->data(), chunk->size(),
+                           chunkname.c_str(), "b");
+    if (ret != 0) { // stale or foreign bytecode, recompile
+      lua_pop(m_luastate, 1);
+      m_bccache->erase(path);
+    }
+  }
 
-protected:
+  if (ret != 0) {
+    ret = luaL_loadfile(m_luastate, filename);
+    if (ret != 0) {
+      popError(m_lasterror, ret);
+    } else {
+      std::string bytecode;
+      lua_dump(m_luastate, luawrapper_detail::dumpWriter, &bytecode, 0);
+      m_bccache->insert(path, mtime, (int64_t)st.st_size, bytecode);
+    }
+  }
 
-  // @brief default constructor.
-  LuaWrapper();
+  if (ret == 0)
+    ret = protectedCall(0, LUA_MULTRET);
+  if (stats)
+    stats->record(elapsedNs(start), ret != 0);
+  return ret == 0 ? 0 : 1;
+}
 
-  // @brief destructor.
-  virtual ~LuaWrapper();
+// setBytecodeCache: sets cache used by doFileCached, default is the global one
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::setBytecodeCache(LuaBytecodeCache* cache) {
+  m_bccache = cache ? cache : &LuaBytecodeCache::global();
+}
 
+// callFunction: with lua functions name and arguments on stack(!), executes
+// the lua functions (in doubt see header description in the beginning).
+// Returns CALL_OK, or CALL_ERROR (0) for every failure with the error
+// described by lastError(), whose code() tells LUA_ERRMEM apart.
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaWrapper::callFunction( int nargs, int nresults ) {
+  LuaCallStats::Entry* stats = NULL;
+  LuaBudget::clock::time_point start;
+  if (m_callstats.enabled()) {
+    stats = m_callstats.entryFor(m_luastate, -(nargs+1));
+    start = LuaBudget::clock::now();
+  }
+  int ret = protectedCall(nargs, nresults);
+  if (stats)
+    stats->record(elapsedNs(start), ret != 0);
+  return ret == 0 ? CALL_OK : CALL_ERROR;
+}
 
-public:
-  // Returns lua state, CAREFUL NOT TO MANAGE WHAT SHOULD BE MANAGED BY THE
-  // LUAWRAPPER LIBRARY!
-  lua_State* getLuaState();
+// protectedCall: lua_pcall with messageHandler inserted below the function,
+// on errors the message is popped into lastError so no I/O or string
+// formatting happens on the error path
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaWrapper::protectedCall(int nargs, int nresults) {
+  armThread(m_luastate); // picks up a profiler started from another thread
+  int base = lua_gettop(m_luastate) - nargs;
+  lua_pushcfunction(m_luastate, &LuaWrapper::messageHandler);
+  lua_insert(m_luastate, base);
+  m_lasterror.m_nframes = 0;
 
-  // wraps lua API for current lua state
-  //////////////////////////////////////////////////////////////////////////////
-  void getGlobal( const char* name );
-  void setGlobal( const char* name );
-  int  doFile( const char* filename );
-  int  callFunction( int nargs, int nresults );
-  void registerFunc( char* funcname, void (*f)(void) );
-  int  doesFuncExist(char* luafuncname);
+  int ret = lua_pcall(m_luastate, nargs, nresults, base);
+  lua_remove(m_luastate, base);
+  if (ret != 0)
+    popError(m_lasterror, ret);
+  return ret;
+}
 
-  // stack manipulation functions
-  //////////////////////////////////////////////////////////////////////////////
-  void        pushNumber( double n );
-  void        pushInt( int n );
-  void        pushString( const char* s );
-  void        pushNil();
-  void        pushLUserdata( void* p );
-  void        pop(){ lua_pop( m_luastate, -1 );}
-  int         popInt();
-  double      popNumber();
-  const char* popString();
-  void*       popUserdata(); // Warning: Careful to use type casting correctly!
-  void        moveToTop(int index);
-  int         isNil( int index ); // query if index value is nil
-  void        createTable(); // Creates table and places on top os stack
-  // While setting/getting table values table must be at the top of the stack.
-  void        pushTableValue(char* key); // Pushes key contents to stack
-  void        pushTableValue(int index); // Pushes index contents to stack
-  void        setTable(); // to use setTable first push key and value to stack
-  int         pop2Ref();
-  void        pushRef(int refval);
+// messageHandler: records the source locations of the failing stack and
+// returns the error message untouched
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaWrapper::messageHandler(lua_State* L) {
+  fromState(L)->m_lasterror.capture(L, 1);
+  return 1;
+}
 
-  void        stackDump();   // Dumps CtoLua stack information for debugging
+// popError: anchors the message on top of stack in err and pops it, non
+// string error objects are described by their type. Runs outside any
+// protected call, so the memory limit is lifted meanwhile.
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::popError(LuaError& err, int code) {
+  size_t limit = m_memlimit;
+  m_memlimit = 0;
+  if (!lua_isstring(m_luastate, -1)) {
+    lua_pushfstring(m_luastate, "(error object is a %s value)",
+                    luaL_typename(m_luastate, -1));
+    lua_remove(m_luastate, -2);
+  }
+  if (&err == &m_lasterror)
+    m_lastabort = CALL_OK; // set again by a budgeted call that tripped
+  err.m_code    = code;
+  err.m_L       = m_luastate;
+  err.m_built   = false;
+  err.m_message = popStringView();
+  m_memlimit = limit;
+}
 
-  FILE* LuaWrapperOpenFile ( char* fname, char* stats );
-  void  LuaWrapperCloseFile( FILE* fp );
+// threadError: the stack of a coroutine that failed is left in place, so its
+// frames can be captured after lua_resume returned
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::threadError(LuaError& err, lua_State* co, int code) {
+  err.capture(co, 0);
+  lua_xmove(co, m_luastate, 1);
+  popError(err, code);
+}
 
-  enum luaType {
-    TNIL       = LUA_TNIL,
-    TBOOL      = LUA_TBOOLEAN,
-    TLUSERDATA = LUA_TLIGHTUSERDATA,
-    TNUMBER    = LUA_TNUMBER,
-    TSTRING    = LUA_TSTRING,
-    TTABLE     = LUA_TTABLE,
-    TFUNCTION  = LUA_TFUNCTION,
-    TUSERDATA  = LUA_TUSERDATA,
-    TTHREAD    = LUA_TTHREAD
-  };
+// callFunction: same as callFunction but with the count hook enforcing
+// budget, a foreign hook is restored afterwards. Calls without limits in
+// budget go straight to the unbounded callFunction. An aborted call returns
+// CALL_ERROR like any other failure, so "if (callFunction(...))" only takes
+// completed calls; lastAbort() then holds the budget that tripped.
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaWrapper::callFunction( int nargs, int nresults,
+                                     const LuaBudget& budget ) {
+  bool timed   = budget.deadline != LuaBudget::clock::time_point::max();
+  bool counted = budget.instructions != 0;
+  if (!timed && !counted)
+    return callFunction(nargs, nresults);
 
-  struct luaObj {
-    void* value;
-    luaType type;
-  };
+  BudgetState saved = m_budget; // calls may nest through C functions
+  m_budget.deadline = budget.deadline;
+  m_budget.left     = (long long)budget.instructions;
+  m_budget.step     = budget.granularity > 0 ? budget.granularity : 1;
+  m_budget.timed    = timed;
+  m_budget.counted  = counted;
+  m_budget.tripped  = CALL_OK;
 
-private:
-  // pointer to the SINGLETON object of this class
-  static LuaWrapper* m_LuaWrapper;
-  // Lua Variables
-  lua_State*       m_luastate;
-  char*            m_status;
-};
+  lua_Hook oldhook  = lua_gethook(m_luastate);
+  int      oldmask  = lua_gethookmask(m_luastate);
+  int      oldcount = lua_gethookcount(m_luastate);
+  updateHook(m_luastate);
 
-////////////////////////////////////////////////////////////////////////////////
+  int ret = callFunction(nargs, nresults);
 
-// Constructor - (bad) Constructor does work to have a global initialization of
-// the lua state by the singleton object
-inline LuaWrapper::LuaWrapper()
-: m_luastate(NULL), // initialize lua state as null
-  m_status(NULL)    // initialize status as null
-{
-  m_luastate = luaL_newstate();   /* opens Lua */
-  luaL_openlibs(m_luastate);      /* auxiliary Lua libs. */
-  luaopen_commands(m_luastate);
+  if (ret == CALL_ERROR && m_budget.tripped != CALL_OK)
+    m_lastabort = m_budget.tripped;
+  m_budget = saved;
+  if (oldhook && oldhook != &LuaWrapper::countHook)
+    lua_sethook(m_luastate, oldhook, oldmask, oldcount);
+  else
+    updateHook(m_luastate);
+  return ret;
 }
 
-// Destructor - finalizes lua state and kills singleton object
-inline LuaWrapper::~LuaWrapper() {
-  if(m_luastate)
-    lua_close(m_luastate);
-  delete m_LuaWrapper;
+// updateHook: installs the count hook on thread L at the finest granularity
+// needed by the active budget and profiler, or removes it when neither is
+// active
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::updateHook(lua_State* L) {
+  int step = hookStep();
+  if (step)
+    lua_sethook(L, &LuaWrapper::countHook, LUA_MASKCOUNT, step);
+  else
+    lua_sethook(L, NULL, 0, 0);
 }
 
-// Singleton instance access method
+// hookStep: finest granularity needed by the active budget and profiler, 0
+// if neither is active. A count budget never steps past its remaining
+// instructions, so budgets below the granularity stop on time.
 ////////////////////////////////////////////////////////////////////////////////
-inline LuaWrapper& LuaWrapper::instance() {
-  return m_LuaWrapper ? *m_LuaWrapper : *(m_LuaWrapper = new LuaWrapper());
+inline int LuaWrapper::hookStep() const {
+  int step = 0;
+  if (m_budget.timed || m_budget.counted) {
+    step = m_budget.tripped != CALL_OK ? 1 : m_budget.step;
+    if (m_budget.counted && m_budget.left < step)
+      step = (int)std::max(m_budget.left, 1LL);
+  }
+  int period = m_profiler.period();
+  if (m_profiler.running() && (step == 0 || period < step))
+    step = period;
+  return step;
 }
 
-// getLuaState: Return lua state, not to be used to handle lua state itself,
-// which should be done internally by THIS library!
+// armThread: installs the count hook on co before it is resumed if a budget
+// or the profiler is active. Foreign hooks are left alone, a count hook left
+// from an earlier call re-arms at the current step.
 ////////////////////////////////////////////////////////////////////////////////
-inline lua_State* LuaWrapper::getLuaState() {
-  return m_luastate;
+inline void LuaWrapper::armThread(lua_State* co) {
+  int step = hookStep();
+  if (!step)
+    return;
+  lua_Hook hook = lua_gethook(co);
+  if (!hook ||
+      (hook == &LuaWrapper::countHook && lua_gethookcount(co) != step))
+    lua_sethook(co, &LuaWrapper::countHook, LUA_MASKCOUNT, step);
 }
 
+// hookCoroutines: replaces coroutine.resume and coroutine.wrap by closures
+// over the originals that arm the thread first, coroutines created before a
+// budget or the profiler started would run unhooked otherwise
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::hookCoroutines() {
+  lua_getglobal(m_luastate, "coroutine");
+  if (lua_istable(m_luastate, -1)) {
+    lua_getfield(m_luastate, -1, "resume");
+    lua_pushcclosure(m_luastate, &LuaWrapper::coResume, 1);
+    lua_setfield(m_luastate, -2, "resume");
+    lua_getfield(m_luastate, -1, "wrap");
+    lua_pushcclosure(m_luastate, &LuaWrapper::coWrap, 1);
+    lua_setfield(m_luastate, -2, "wrap");
+  }
+  lua_pop(m_luastate, 1);
+}
 
+// coResume: coroutine.resume arming its thread
 ////////////////////////////////////////////////////////////////////////////////
-// Stack Manipulation Functions
+inline int LuaWrapper::coResume(lua_State* L) {
+  lua_State* co = lua_tothread(L, 1);
+  if (co)
+    fromState(L)->armThread(co);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_insert(L, 1);
+  lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+  return lua_gettop(L);
+}
+
+// coWrap: coroutine.wrap returning a closure over the original wrapper and
+// the coroutine, its first upvalue
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaWrapper::coWrap(lua_State* L) {
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_insert(L, 1);
+  lua_call(L, lua_gettop(L) - 1, 1);
+  if (!lua_getupvalue(L, -1, 1))
+    lua_pushnil(L);
+  lua_pushcclosure(L, &LuaWrapper::coWrapped, 2);
+  return 1;
+}
+
+// coWrapped: arms the coroutine and calls the original wrapper. Its errors
+// get the caller's position here, where the original would have added it.
 ////////////////////////////////////////////////////////////////////////////////
+inline int LuaWrapper::coWrapped(lua_State* L) {
+  lua_State* co = lua_tothread(L, lua_upvalueindex(2));
+  if (co)
+    fromState(L)->armThread(co);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_insert(L, 1);
+  int ret = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+  if (ret == LUA_OK)
+    return lua_gettop(L);
+  if (ret != LUA_ERRMEM && lua_type(L, -1) == LUA_TSTRING) {
+    luaL_where(L, 1);
+    lua_insert(L, -2);
+    lua_concat(L, 2);
+  }
+  return lua_error(L);
+}
 
-// pushNumber: pushes a number to lua stack
+// countHook: charges the instructions since the last call on thread L to the
+// profiler and the budget, then re-arms L if the step needed changed: the
+// profiler started or stopped, possibly from another thread, or the budget
+// tripped. A tripped budget keeps raising on every instruction of L so
+// scripts cannot pcall their way past it. Coroutines inherit the hook of the
+// thread creating them or get it from armThread, one that fires with neither
+// budget nor profiler active is removed.
 ////////////////////////////////////////////////////////////////////////////////
-inline void LuaWrapper::pushNumber(double n) {
-  lua_pushnumber(m_luastate, n);
+inline void LuaWrapper::countHook(lua_State* L, lua_Debug*) {
+  LuaWrapper* self = fromState(L);
+  BudgetState& b = self->m_budget;
+  int n = lua_gethookcount(L);
+
+  if (self->m_profiler.running())
+    self->m_profiler.tick(L, n);
+
+  bool budgeted = b.timed || b.counted;
+  if (budgeted && b.tripped == CALL_OK) {
+    if (b.counted) {
+      b.left -= n;
+      if (b.left <= 0)
+        b.tripped = CALL_BUDGET;
+    }
+    if (b.timed && b.tripped == CALL_OK &&
+        LuaBudget::clock::now() >= b.deadline)
+      b.tripped = CALL_DEADLINE;
+  }
+  if (self->hookStep() != n)
+    self->updateHook(L);
+  if (!budgeted || b.tripped == CALL_OK)
+    return;
+
+  luaL_error(L, b.tripped == CALL_BUDGET ? "instruction budget exceeded"
+                                         : "deadline exceeded");
 }
 
-// pushInt: pushes an integer to lua stack
+// enableCallStats: starts or stops recording call statistics
 ////////////////////////////////////////////////////////////////////////////////
-inline void LuaWrapper::pushInt(int n) {
-  lua_pushinteger(m_luastate, n);
+inline void LuaWrapper::enableCallStats(bool enabled) {
+  m_callstats.setEnabled(enabled);
 }
 
-// pushString: pushes a c format string to lua stack
+// setGCMode: switches between incremental and generational collection
 ////////////////////////////////////////////////////////////////////////////////
-inline void LuaWrapper::pushString(const char* s) {
-  lua_pushstring(m_luastate, s);
+inline bool LuaWrapper::setGCMode(gcMode mode, int minormul, int majormul) {
+#if LUA_VERSION_NUM >= 504
+  if (mode == GC_GENERATIONAL)
+    lua_gc(m_luastate, LUA_GCGEN, minormul, majormul);
+  else
+    lua_gc(m_luastate, LUA_GCINC, 0, 0, 0);
+  return true;
+#else
+  (void)minormul;
+  (void)majormul;
+  return mode == GC_INCREMENTAL;
+#endif
 }
 
-// pushNil: pushes nil (lua NULL type)
+// setGCTuning: sets the incremental collector pause and step multiplier
 ////////////////////////////////////////////////////////////////////////////////
-inline void LuaWrapper::pushNil() {
-  lua_pushnil(m_luastate);
+inline void LuaWrapper::setGCTuning(int pause, int stepmul) {
+  if (pause > 0)
+    lua_gc(m_luastate, LUA_GCSETPAUSE, pause);
+  if (stepmul > 0)
+    lua_gc(m_luastate, LUA_GCSETSTEPMUL, stepmul);
 }
 
-// pushUserdata: Pushed a generic (light/no GC) userdata type to stack
+// gcStep: runs and times one basic collector step
 ////////////////////////////////////////////////////////////////////////////////
-inline void LuaWrapper::pushLUserdata(void* p) {
-  lua_pushlightuserdata(m_luastate, p);
+inline bool LuaWrapper::gcStep() {
+  if (m_nogc > 0)
+    return false;
+  LuaBudget::clock::time_point start = LuaBudget::clock::now();
+  int done = lua_gc(m_luastate, LUA_GCSTEP, 0);
+  m_gcstats.record(elapsedNs(start), false);
+  return done != 0;
 }
 
-// popInt: Pops an integer from the stack
+// gcIdle: steps the collector until a cycle completes or budget is used up,
+// a step is never cut short so the last one may overrun the budget
 ////////////////////////////////////////////////////////////////////////////////
-inline int LuaWrapper::popInt() {
-  if (!lua_isnumber(m_luastate, -1))
-  {
-    luaL_error(m_luastate,
-               "ERROR: C-Lua stack value type mismatch (should be a number)!");
+inline bool LuaWrapper::gcIdle(std::chrono::nanoseconds budget) {
+  if (m_nogc > 0)
+    return false;
+  LuaBudget::clock::time_point deadline = LuaBudget::clock::now() +
+    std::chrono::duration_cast<LuaBudget::clock::duration>(budget);
+  while (LuaBudget::clock::now() < deadline) {
+    if (gcStep())
+      return true;
   }
-  int n = lua_tointeger(m_luastate, -1);
-  lua_pop(m_luastate, 1);
+  return false;
+}
 
-  return n;
+// gcCollect: runs and times a full collection
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::gcCollect() {
+  if (m_nogc > 0)
+    return;
+  LuaBudget::clock::time_point start = LuaBudget::clock::now();
+  lua_gc(m_luastate, LUA_GCCOLLECT, 0);
+  m_gcstats.record(elapsedNs(start), true);
 }
 
-// popNumber: Pops a double from the stack
+// gcBytes: memory in use by the state in bytes
 ////////////////////////////////////////////////////////////////////////////////
-inline double LuaWrapper::popNumber() {
-  if (!lua_isnumber(m_luastate, -1)) {
-    luaL_error(m_luastate,
-               "ERROR: C-Lua stack value type mismatch (should be a number)!");
+inline size_t LuaWrapper::gcBytes() {
+  return (size_t)lua_gc(m_luastate, LUA_GCCOUNT, 0) * 1024 +
+         (size_t)lua_gc(m_luastate, LUA_GCCOUNTB, 0);
+}
+
+// gcSentinel: __gc of an unreachable userdata, so it runs once per completed
+// cycle. Counts the cycle and leaves a new sentinel for the next one.
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaWrapper::gcSentinel(lua_State* L) {
+  LuaWrapper* self = fromState(L);
+  self->m_gcstats.m_cycles.fetch_add(1, std::memory_order_relaxed);
+  if (!self->m_gcstats.m_closing) {
+    luawrapper_detail::newUserdata(L, 1);
+    lua_getmetatable(L, 1);
+    lua_setmetatable(L, -2);
+    lua_pop(L, 1);
   }
+  return 0;
+}
 
-  double num = lua_tonumber (m_luastate, -1);
+// armGCSentinel: creates the first sentinel and its metatable
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::armGCSentinel() {
+  luawrapper_detail::newUserdata(m_luastate, 1);
+  lua_createtable(m_luastate, 0, 1);
+  lua_pushcfunction(m_luastate, &LuaWrapper::gcSentinel);
+  lua_setfield(m_luastate, -2, "__gc");
+  lua_setmetatable(m_luastate, -2);
   lua_pop(m_luastate, 1);
+}
 
-  return num;
+// setMemoryLimit: sets the memory limit, wrapping the state's allocator the
+// first time a limit is set. Usage starts from what the collector counts.
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::setMemoryLimit(size_t limit) {
+  if (limit && !m_allocf) {
+    m_allocf  = lua_getallocf(m_luastate, &m_allocud);
+    m_memused = gcBytes();
+    lua_setallocf(m_luastate, &LuaWrapper::limitAlloc, this);
+  }
+  m_memlimit = limit;
 }
 
-// popString: Pops a string from the stack
+// limitAlloc: refuses growth past the limit, lua then collects and retries
+// before it raises the memory error. Frees and shrinks always go through.
 ////////////////////////////////////////////////////////////////////////////////
-inline const char*
-LuaWrapper::popString() {
-  if (!lua_isstring(m_luastate, -1)) {
-    luaL_error(m_luastate,
-               "ERROR: C-Lua stack value type mismatch (should be a string)!");
+inline void* LuaWrapper::limitAlloc(void* ud, void* ptr, size_t osize,
+                                    size_t nsize) {
+  LuaWrapper* self = (LuaWrapper*)ud;
+  size_t old = ptr ? osize : 0; // osize is a type tag for new blocks
+  if (nsize > old && self->m_memlimit &&
+      self->m_memused + (nsize - old) > self->m_memlimit)
+    return NULL;
+
+  void* p = self->m_allocf(self->m_allocud, ptr, osize, nsize);
+  if (p || nsize == 0)
+    self->m_memused = self->m_memused - old + nsize;
+  return p;
+}
+
+// saveBaseline: stores {table, copy, metatable or false, key count, ...} for
+// the tracked tables under a registry key, replacing an earlier baseline.
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::saveBaseline() {
+  LUAWRAPPER_STACK_CHECK(m_luastate, 0);
+  lua_newtable(m_luastate);
+  int list = lua_gettop(m_luastate);
+  lua_pushvalue(m_luastate, list);
+  lua_rawsetp(m_luastate, LUA_REGISTRYINDEX, baselineKey());
+  lua_newtable(m_luastate);
+  int seen = lua_gettop(m_luastate);
+
+  lua_rawgeti(m_luastate, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+  trackTable(list, seen, lua_gettop(m_luastate));
+  lua_pushvalue(m_luastate, LUA_REGISTRYINDEX);
+  trackTable(list, seen, lua_gettop(m_luastate));
+  lua_pop(m_luastate, 2);
+
+  lua_getfield(m_luastate, LUA_REGISTRYINDEX, "_LOADED");
+  if (lua_istable(m_luastate, -1)) {
+    int loaded = lua_gettop(m_luastate);
+    trackTable(list, seen, loaded);
+    lua_pushnil(m_luastate);
+    while (lua_next(m_luastate, loaded)) {
+      if (lua_istable(m_luastate, -1))
+        trackTable(list, seen, lua_gettop(m_luastate));
+      lua_pop(m_luastate, 1);
+    }
   }
+  lua_pop(m_luastate, 3);
+}
 
-  const char* string = lua_tostring(m_luastate, -1);
+// trackTable: appends table, a shallow copy, its metatable and the copy's
+// key count to list unless seen already. Numeric registry keys are
+// references and lightuserdata ones belong to the wrapper, both are left out.
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::trackTable(int list, int seen, int table) {
+  lua_pushvalue(m_luastate, table);
+  lua_rawget(m_luastate, seen);
+  bool tracked = lua_toboolean(m_luastate, -1) != 0;
   lua_pop(m_luastate, 1);
+  if (tracked)
+    return;
+  lua_pushvalue(m_luastate, table);
+  lua_pushboolean(m_luastate, 1);
+  lua_rawset(m_luastate, seen);
 
-  return string;
+  bool named = lua_rawequal(m_luastate, table, LUA_REGISTRYINDEX) != 0;
+  int n = (int)lua_rawlen(m_luastate, list);
+  lua_pushvalue(m_luastate, table);
+  lua_rawseti(m_luastate, list, n + 1);
+  lua_newtable(m_luastate);
+  lua_Integer count = 0;
+  lua_pushnil(m_luastate);
+  while (lua_next(m_luastate, table)) {
+    if (named && (lua_type(m_luastate, -2) == LUA_TNUMBER ||
+                  lua_type(m_luastate, -2) == LUA_TLIGHTUSERDATA)) {
+      lua_pop(m_luastate, 1);
+      continue;
+    }
+    lua_pushvalue(m_luastate, -2);
+    lua_insert(m_luastate, -2);
+    lua_rawset(m_luastate, -4);
+    count++;
+  }
+  lua_rawseti(m_luastate, list, n + 2);
+  if (!lua_getmetatable(m_luastate, table))
+    lua_pushboolean(m_luastate, 0);
+  lua_rawseti(m_luastate, list, n + 3);
+  lua_pushinteger(m_luastate, count);
+  lua_rawseti(m_luastate, list, n + 4);
 }
 
-// popUserdata: Pops userdata generic lua type from the stack, extra care must
-// by taken when type casting
+// reset: restores every tracked table to its baseline copy, then steps the
+// collector for up to gcBudget
 ////////////////////////////////////////////////////////////////////////////////
-inline void*
-LuaWrapper::popUserdata() {
-  if (!lua_isuserdata(m_luastate, -1)) {
-    luaL_error(m_luastate,
-               "ERROR: C-Lua stack value type mismatch (should be userdata)!");
+inline bool LuaWrapper::reset(std::chrono::nanoseconds gcBudget) {
+  assert(m_nogc == 0 && "reset inside a LuaNoGCRegion");
+  assert(!m_budget.timed && !m_budget.counted && "reset in a budgeted call");
+  assert(!m_profiler.running() && "reset while profiling");
+  lua_settop(m_luastate, 0);
+  m_lasterror.clear();
+  lua_rawgetp(m_luastate, LUA_REGISTRYINDEX, baselineKey());
+  if (!lua_istable(m_luastate, 1)) {
+    lua_settop(m_luastate, 0);
+    return false;
   }
 
-  void* vp = lua_touserdata(m_luastate, -1);
-  lua_pop(m_luastate, 1);
+  int n = (int)lua_rawlen(m_luastate, 1);
+  for (int i = 1; i + 3 <= n; i += 4) {
+    lua_rawgeti(m_luastate, 1, i);     // 2: table
+    lua_rawgeti(m_luastate, 1, i + 1); // 3: copy
+    lua_rawgeti(m_luastate, 1, i + 2); // 4: metatable or false
+    lua_rawgeti(m_luastate, 1, i + 3);
+    int count = (int)lua_tointeger(m_luastate, -1);
+    lua_pop(m_luastate, 1);
+    restoreTable(2, 3, count,
+                 lua_rawequal(m_luastate, 2, LUA_REGISTRYINDEX) != 0);
+    if (!lua_getmetatable(m_luastate, 2))
+      lua_pushboolean(m_luastate, 0);
+    if (!lua_rawequal(m_luastate, -1, 4)) {  // 5: current metatable
+      if (lua_istable(m_luastate, 4))
+        lua_pushvalue(m_luastate, 4);
+      else
+        lua_pushnil(m_luastate);
+      lua_setmetatable(m_luastate, 2);
+    }
+    lua_settop(m_luastate, 1);
+  }
+  lua_settop(m_luastate, 0);
+  if (gcBudget > std::chrono::nanoseconds::zero())
+    gcIdle(gcBudget);
+  return true;
+}
 
-  return vp;
+// restoreTable: removes keys of table missing from copy and resets changed
+// values while traversing table (allowed for existing fields), then puts
+// back keys the table lost unless all count baseline keys were seen. Raw
+// accesses bypass metamethods.
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::restoreTable(int table, int copy, int count,
+                                     bool named) {
+  int kept = 0; // baseline keys still present
+  lua_pushnil(m_luastate);
+  while (lua_next(m_luastate, table)) {
+    if (named && (lua_type(m_luastate, -2) == LUA_TNUMBER ||
+                  lua_type(m_luastate, -2) == LUA_TLIGHTUSERDATA)) {
+      lua_pop(m_luastate, 1);
+      continue;
+    }
+    lua_pushvalue(m_luastate, -2);
+    lua_rawget(m_luastate, copy);    // key, value, baseline value
+    if (lua_isnil(m_luastate, -1)) {
+      lua_pop(m_luastate, 2);
+      lua_pushvalue(m_luastate, -1);
+      lua_pushnil(m_luastate);
+      lua_rawset(m_luastate, table); // added since the baseline
+    } else if (!lua_rawequal(m_luastate, -1, -2)) {
+      lua_pushvalue(m_luastate, -3);
+      lua_insert(m_luastate, -2);
+      lua_rawset(m_luastate, table); // replaced
+      lua_pop(m_luastate, 1);
+      kept++;
+    } else {
+      lua_pop(m_luastate, 2);
+      kept++;
+    }
+  }
+  if (kept == count)
+    return; // none removed
+
+  lua_pushnil(m_luastate);
+  while (lua_next(m_luastate, copy)) {
+    lua_pushvalue(m_luastate, -2);
+    lua_rawget(m_luastate, table);
+    if (lua_isnil(m_luastate, -1)) {
+      lua_pop(m_luastate, 1);
+      lua_pushvalue(m_luastate, -2);
+      lua_insert(m_luastate, -2);
+      lua_rawset(m_luastate, table); // removed since the baseline
+    } else {
+      lua_pop(m_luastate, 2);
+    }
+  }
 }
 
-// moveToTop: Moves stack index to top of stack (-1 index)
+// stopGC: stops the collector when the first region opens
 ////////////////////////////////////////////////////////////////////////////////
-inline void LuaWrapper::moveToTop(int index) {
-  lua_settop(m_luastate, index);
+inline void LuaWrapper::stopGC() {
+  if (m_nogc++ > 0)
+    return;
+  m_gcwasrunning = lua_gc(m_luastate, LUA_GCISRUNNING, 0) != 0;
+  lua_gc(m_luastate, LUA_GCSTOP, 0);
 }
 
-// isNil: Queries stack at "index" if entry is nil
+// restartGC: restarts the collector when the last region closes, one step
+// then catches up with the garbage left meanwhile (the count is already
+// down, so gcStep runs)
 ////////////////////////////////////////////////////////////////////////////////
-inline int LuaWrapper::isNil( int index ) {
-  int ret = lua_isnil( m_luastate, index );
-  return ret;
+inline void LuaWrapper::restartGC() {
+  if (--m_nogc > 0 || !m_gcwasrunning)
+    return;
+  lua_gc(m_luastate, LUA_GCRESTART, 0);
+  gcStep();
 }
 
-// createTable: Creates a lua table and places it on top of stack
+// startProfiler: starts sampling the stack every period instructions. The
+// state is not touched here, its thread arms the hook (see LuaProfiler).
 ////////////////////////////////////////////////////////////////////////////////
-inline void LuaWrapper::createTable() {
-  lua_newtable(m_luastate);
+inline void LuaWrapper::startProfiler(int period) {
+  m_profiler.start(period);
 }
 
-// pushTableValue: Gets field from table at top of stack and pushes value to
-// top of the stack
+// stopProfiler: stops sampling, collected samples are kept. The hook removes
+// or re-arms itself the next time it fires.
 ////////////////////////////////////////////////////////////////////////////////
-inline void LuaWrapper::pushTableValue(int index) {
-  if (!lua_istable(m_luastate, -1))
-    luaL_error(m_luastate,
-      "ERROR: Trying to get table value without table at top of stack!");
-  lua_pushinteger(m_luastate, index);
-  lua_gettable(m_luastate, -2);
+inline void LuaWrapper::stopProfiler() {
+  m_profiler.stop();
 }
 
-// pushTableValue: Gets field from table at top of stack and pushes value to
-// top of the stack
+// registerFunc: Registers C function in lua namespace with name: funcname
 ////////////////////////////////////////////////////////////////////////////////
-inline void LuaWrapper::pushTableValue(char* key) {
-  if (!lua_istable(m_luastate, -1))
-    luaL_error(m_luastate,
-      "ERROR: Trying to get table value without table at top of stack!");
-  lua_pushstring(m_luastate, key);
-  lua_gettable(m_luastate, -2);
+inline void LuaWrapper::registerFunc( const char* funcname, void (*f)(void)) {
+  lua_register(m_luastate, funcname, (lua_CFunction)f);
+}
+
+// registerFunc: Registers lua C function in lua namespace with name: funcname
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::registerFunc( const char* funcname, lua_CFunction f ) {
+  lua_register(m_luastate, funcname, f);
+}
+
+// registerFunc: Registers C++ function through a trampoline generated for its
+// signature, the function pointer is kept in the trampoline upvalue
+////////////////////////////////////////////////////////////////////////////////
+template <class R, class... Args>
+inline void LuaWrapper::registerFunc( const char* funcname, R (*f)(Args...) ) {
+  typedef R (*Function)(Args...);
+  void* p = luawrapper_detail::newUserdata(m_luastate, sizeof(Function));
+  memcpy(p, &f, sizeof(Function));
+  lua_pushcclosure(m_luastate,
+                   &luawrapper_detail::functionTrampoline<R, Args...>, 1);
+  lua_setglobal(m_luastate, funcname);
+}
+
+// registerFunc: Registers lambda or functor as a closure holding the callable
+// in an upvalue, destructors run when lua collects the closure
+////////////////////////////////////////////////////////////////////////////////
+template <class F>
+inline typename std::enable_if<
+  std::is_class<typename std::decay<F>::type>::value>::type
+LuaWrapper::registerFunc( const char* funcname, F&& f ) {
+  luawrapper_detail::pushClosure(m_luastate, std::forward<F>(f));
+  lua_setglobal(m_luastate, funcname);
 }
 
-// setTable: Same functioning as lua api. with table on top of stack first push
-// key then value, and finally call setTable to set lua table values.
+// registerMethod: Registers member function bound to obj, the object and
+// member pointers are kept inline in the closure upvalue
 ////////////////////////////////////////////////////////////////////////////////
-inline void LuaWrapper::setTable() {
-  if (!lua_istable(m_luastate, -3))
-    luaL_error(m_luastate,
-      "ERROR: Trying to set table without pushing key and value to stack!");
-  lua_settable(m_luastate, -3);
+template <class T, class M>
+inline void LuaWrapper::registerMethod( const char* funcname, T* obj,
+                                        M method ) {
+  luawrapper_detail::BoundMethod<T, M> bound = { obj, method };
+  luawrapper_detail::pushClosure(m_luastate, bound);
+  lua_setglobal(m_luastate, funcname);
 }
 
+// registerModule: registers a source or bytecode chunk as module name
 ////////////////////////////////////////////////////////////////////////////////
-// C-Lua API Functions
+inline void LuaWrapper::registerModule(const char* name, const char* chunk,
+                                       size_t size) {
+  Module& m = m_modules[name];
+  m.chunk.assign(chunk, size);
+  m.opener = NULL;
+  installSearcher();
+}
+
+// registerModule: registers a C function opening module name
 ////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::registerModule(const char* name,
+                                       lua_CFunction opener) {
+  Module& m = m_modules[name];
+  m.chunk.clear();
+  m.opener = opener;
+  installSearcher();
+}
 
-// getGlobal: gets global namespace lua variable with stack. Used to access lua
-// variables from C
+// unregisterModule: forgets module name, a loaded module stays loaded
 ////////////////////////////////////////////////////////////////////////////////
-inline void LuaWrapper::getGlobal(const char* name) {
-  lua_getglobal(m_luastate, name);
+inline void LuaWrapper::unregisterModule(const char* name) {
+  m_modules.erase(name);
 }
 
-// setglobal: sets global namespace lua variable with stack. Used to set lua
-// variables from C
+// registerBundle: adds bundle to the modules searched by require
 ////////////////////////////////////////////////////////////////////////////////
-inline void LuaWrapper::setGlobal(const char* name) {
-  lua_setglobal(m_luastate, name);
+inline void LuaWrapper::registerBundle(const LuaBundle* bundle) {
+  m_bundles.push_back(bundle);
+  installSearcher();
 }
 
-// dofile: executes lua file, returns 0 if there are no errors or 1 in case of
-// errors.
+// unregisterBundle: removes bundle from the modules searched by require
 ////////////////////////////////////////////////////////////////////////////////
-inline int LuaWrapper::doFile(const char* filename) {
-  int ret = luaL_dofile(m_luastate, filename);
-  if ( ret == 1 ) {
-    printf("Error running LuaWrapper::dofile doing file: %s\nerror: %s\n",
-           filename, lua_tostring(m_luastate, -1));
+inline void LuaWrapper::unregisterBundle(const LuaBundle* bundle) {
+  m_bundles.erase(std::remove(m_bundles.begin(), m_bundles.end(), bundle),
+                  m_bundles.end());
+}
+
+// installSearcher: inserts moduleSearcher as first package searcher, once
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaWrapper::installSearcher() {
+  if (m_searcher)
+    return;
+  LUAWRAPPER_STACK_CHECK(m_luastate, 0);
+  lua_getglobal(m_luastate, "package");
+  if (!lua_istable(m_luastate, -1)) {
+    lua_pop(m_luastate, 1);
+    return;
   }
-  return ret;
+  lua_getfield(m_luastate, -1, "searchers");
+  if (lua_istable(m_luastate, -1)) {
+    for (int i = (int)lua_rawlen(m_luastate, -1); i >= 1; i--) {
+      lua_rawgeti(m_luastate, -1, i);
+      lua_rawseti(m_luastate, -2, i + 1);
+    }
+    lua_pushcfunction(m_luastate, &LuaWrapper::moduleSearcher);
+    lua_rawseti(m_luastate, -2, 1);
+    m_searcher = true;
+  }
+  lua_pop(m_luastate, 2);
 }
 
-// callFunction: with lua functions name and arguments on stack(!), executes
-// the lua functions (in doubt see header description in the beginning)
+// moduleSearcher: returns the loader of a registered module or bundled
+// module and the extra loader argument, or why the module was not found
 ////////////////////////////////////////////////////////////////////////////////
-inline int LuaWrapper::callFunction( int nargs, int nresults ) {
-  if (lua_pcall(m_luastate, nargs, nresults, 0) != 0) {
-    printf( "Error running function %s: %s",
-            lua_tostring(m_luastate, -(nargs+1)),
-            lua_tostring(m_luastate, -1) );
-    return 0;
+inline int LuaWrapper::moduleSearcher(lua_State* L) {
+  const char* name = luaL_checkstring(L, 1);
+  LuaWrapper* self = fromState(L);
+
+  const char* chunk = NULL;
+  size_t      size  = 0;
+  std::unordered_map<std::string, Module>::const_iterator it =
+    self->m_modules.find(name);
+  if (it != self->m_modules.end()) {
+    if (it->second.opener) {
+      lua_pushcfunction(L, it->second.opener);
+      lua_pushliteral(L, ":luawrapper:");
+      return 2;
+    }
+    chunk = it->second.chunk.data();
+    size  = it->second.chunk.size();
   } else {
+    for (size_t i = 0; i < self->m_bundles.size(); i++) {
+      if (self->m_bundles[i]->find(name, chunk, size))
+        break;
+      chunk = NULL;
+    }
+  }
+
+  if (!chunk) {
+#if LUA_VERSION_NUM >= 504
+    lua_pushfstring(L, "no module '%s' registered with LuaWrapper", name);
+#else
+    lua_pushfstring(L, "\n\tno module '%s' registered with LuaWrapper", name);
+#endif
     return 1;
   }
-}
 
-// registerFunc: Registers C function in lua namespace with name: funcname
-////////////////////////////////////////////////////////////////////////////////
-inline void LuaWrapper::registerFunc( char* funcname, void (*f)(void)) {
-  lua_register(m_luastate, funcname, (lua_CFunction)f);
+  int ret;
+  { // destroyed before luaL_error jumps
+    luawrapper_detail::Chunk reader = { chunk, size };
+    std::string chunkname = std::string("@") + name;
+    ret = lua_load(L, luawrapper_detail::chunkReader, &reader,
+                   chunkname.c_str(), NULL);
+  }
+  if (ret != 0) {
+    return luaL_error(L, "error loading module '%s':\n\t%s", name,
+                      lua_tostring(L, -1));
+  }
+  lua_pushliteral(L, ":luawrapper:");
+  return 2;
 }
 
 // doesFuncExist: return true if function exists and false otherwise
 ////////////////////////////////////////////////////////////////////////////////
 inline int LuaWrapper::doesFuncExist(char* luafuncname) {
+  LUAWRAPPER_STACK_CHECK(m_luastate, 0);
   getGlobal(luafuncname);
   int funcexists = lua_isfunction(m_luastate, -1);
   pop();
@@ -348,6 +3585,71 @@ inline int LuaWrapper::doesFuncExist(char* luafuncname) {
   }
 }
 
+// call: pushes function and arguments with the argument and result counts
+// known at compile time, then calls it and reads the results
+////////////////////////////////////////////////////////////////////////////////
+template <class R, class... Args>
+inline R LuaWrapper::call( const char* name, Args&&... args ) {
+  LUAWRAPPER_STACK_CHECK(m_luastate, 0);
+  getGlobal(name);
+  return callPushed<R>(std::forward<Args>(args)...);
+}
+
+// callPushed: calls function on top of stack and pops its results
+////////////////////////////////////////////////////////////////////////////////
+template <class R, class... Args>
+inline R LuaWrapper::callPushed( Args&&... args ) {
+  typedef luawrapper_detail::Results<R> results;
+  luawrapper_detail::pushAll(m_luastate, std::forward<Args>(args)...);
+  if (callFunction(sizeof...(Args), results::count) != CALL_OK)
+    return R();
+  struct Popper {
+    lua_State* L;
+    ~Popper() { lua_pop(L, results::count); }
+  } popper = { m_luastate };
+  return results::get(m_luastate);
+}
+
+// getFunction: looks global function up once and returns a handle holding a
+// registry reference to it
+////////////////////////////////////////////////////////////////////////////////
+inline LuaFunction LuaWrapper::getFunction( const char* name ) {
+  lua_getglobal(m_luastate, name);
+  if (!lua_isfunction(m_luastate, -1)) {
+    lua_pop(m_luastate, 1);
+    return LuaFunction(this, LuaRef()); // calls fail with lastError()
+  }
+  return LuaFunction(this, pop2LuaRef());
+}
+
+// pushStruct: pushes a table with every field described by LuaStruct<T>
+////////////////////////////////////////////////////////////////////////////////
+template <class T>
+inline void LuaWrapper::pushStruct(const T& s) {
+  LUAWRAPPER_STACK_CHECK(m_luastate, 1);
+  int nfields = luawrapper_detail::pushStructKeys<T>(m_luastate);
+  lua_createtable(m_luastate, 0, nfields);
+  luawrapper_detail::FieldPusher<T> push =
+    { m_luastate, lua_gettop(m_luastate) - 1, lua_gettop(m_luastate), 0, &s };
+  LuaStruct<T>::fields(push);
+  lua_remove(m_luastate, -2); // keys
+}
+
+// readStruct: reads fields described by LuaStruct<T> from table at index
+////////////////////////////////////////////////////////////////////////////////
+template <class T>
+inline void LuaWrapper::readStruct(int index, T& s) {
+  if (!lua_istable(m_luastate, index))
+    luaL_error(m_luastate,
+      "ERROR: C-Lua stack value type mismatch (should be a table)!");
+  index = lua_absindex(m_luastate, index);
+  luawrapper_detail::pushStructKeys<T>(m_luastate);
+  luawrapper_detail::FieldReader<T> read =
+    { m_luastate, lua_gettop(m_luastate), index, 0, &s };
+  LuaStruct<T>::fields(read);
+  lua_pop(m_luastate, 1); // keys
+}
+
 // makeRef: creates a reference to lua stack variables, useful for passing lua
 // information without manipulating the stack from other function entry points
 ////////////////////////////////////////////////////////////////////////////////
@@ -362,6 +3664,15 @@ inline void LuaWrapper::pushRef(int refval) {
   luaL_unref(m_luastate, LUA_REGISTRYINDEX, refval);
 }
 
+// pop2LuaRef: pops top of stack into a persistent reference, unlike pop2Ref
+// the value can be pushed any number of times until the LuaRef is released
+////////////////////////////////////////////////////////////////////////////////
+inline LuaRef LuaWrapper::pop2LuaRef() {
+  LUAWRAPPER_STACK_CHECK(m_luastate, -1);
+  int slot = m_refslab.store();
+  return LuaRef(&m_refslab, slot);
+}
+
 // stackDump: Dumps contents of stack for debugging purposes
 ////////////////////////////////////////////////////////////////////////////////
 inline void LuaWrapper::stackDump() {
@@ -404,4 +3715,701 @@ inline void LuaWrapper::LuaWrapperCloseFile( FILE* fp ) {
   callFunction(0, 0);
 }
 
+// LuaStackGuard::mark: raises the high-water mark of L's wrapper to top,
+// debug builds only
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaStackGuard::mark(lua_State* L, int top) {
+#ifdef NDEBUG
+  (void)L;
+  (void)top;
+#else
+  LuaWrapper* lw = LuaWrapper::fromState(L);
+  if (lw && top > lw->m_stackhigh)
+    lw->m_stackhigh = top;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// LuaNoGCRegion: keeps the collector of a wrapper stopped while the object
+// lives, e.g. around a latency critical section. Regions nest, when the
+// outermost one ends the collector is restarted (unless it was already
+// stopped) and a timed step catches up with the garbage left meanwhile.
+// Memory grows unchecked inside a region, keep them short.
+////////////////////////////////////////////////////////////////////////////////
+
+class LuaNoGCRegion {
+
+public:
+  explicit LuaNoGCRegion(LuaWrapper& lw) : m_wrapper(lw) { lw.stopGC(); }
+  ~LuaNoGCRegion() { m_wrapper.restartGC(); }
+
+  LuaNoGCRegion(const LuaNoGCRegion&) = delete;
+  LuaNoGCRegion& operator=(const LuaNoGCRegion&) = delete;
+
+private:
+  LuaWrapper& m_wrapper;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// LuaClass: binds C++ class T as full userdata. Objects are constructed in
+// place inside the userdata, share one metatable per state whose __index is
+// the methods table, and are destroyed by __gc. Methods receive a type checked
+// self at stack index 1. Usage:
+//
+//   LuaClass<Point>(luaWrap, "Point")
+//     .constructor<double, double>()        // Point.new(x, y)
+//     .method("length", &Point::luaLength); // int Point::luaLength(lua_State*)
+////////////////////////////////////////////////////////////////////////////////
+
+template <class T>
+class LuaClass {
+
+public:
+  typedef int (T::*Method)(lua_State* L);
+
+  // @brief creates the metatable of T and the global methods table "name".
+  LuaClass(LuaWrapper& lw, const char* name);
+
+  LuaClass& method(const char* name, lua_CFunction f);
+  LuaClass& method(const char* name, Method m);
+  // binds T(Args...) as the "name" function of the methods table
+  template <class... Args>
+  LuaClass& constructor(const char* name = "new");
+
+  // constructs a T in a new userdata on top of stack
+  template <class... Args>
+  static T* push(lua_State* L, Args&&... args);
+  // returns the T at index or raises a lua argument error
+  static T* check(lua_State* L, int index);
+  // returns the T at index or NULL if it is not a T
+  static T* test(lua_State* L, int index);
+
+private:
+  static char tag; // registry key of the metatable
+
+  void pushMethods();
+  static int gc(lua_State* L);
+  static int callMethod(lua_State* L);
+  template <class... Args, int... I>
+  static int construct(lua_State* L, luawrapper_detail::Indices<I...>);
+  template <class... Args>
+  static int construct(lua_State* L);
+
+  lua_State* m_luastate;
+};
+
+template <class T>
+char LuaClass<T>::tag;
+
+// Constructor - registers metatable with __index, __gc and __name fields. A
+// class registered before keeps its metatable and methods table, so existing
+// objects still pass test(); the global and __name take the new name.
+////////////////////////////////////////////////////////////////////////////////
+template <class T>
+inline LuaClass<T>::LuaClass(LuaWrapper& lw, const char* name)
+: m_luastate(lw.getLuaState())
+{
+  lua_State* L = m_luastate;
+  if (lua_rawgetp(L, LUA_REGISTRYINDEX, &tag) == LUA_TTABLE) {
+    lua_getfield(L, -1, "__index");
+    lua_setglobal(L, name);
+    lua_pushstring(L, name);
+    lua_setfield(L, -2, "__name");
+    lua_pop(L, 1);
+    return;
+  }
+  lua_pop(L, 1);
+
+  lua_createtable(L, 0, 3);              // metatable
+  lua_newtable(L);                       // methods
+  lua_pushvalue(L, -1);
+  lua_setglobal(L, name);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, &LuaClass<T>::gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pushstring(L, name);
+  lua_setfield(L, -2, "__name");
+  lua_rawsetp(L, LUA_REGISTRYINDEX, &tag);
+}
+
+// method: adds a C function method, self is at index 1
+////////////////////////////////////////////////////////////////////////////////
+template <class T>
+inline LuaClass<T>& LuaClass<T>::method(const char* name, lua_CFunction f) {
+  pushMethods();
+  lua_pushcfunction(m_luastate, f);
+  lua_setfield(m_luastate, -2, name);
+  lua_pop(m_luastate, 1);
+  return *this;
+}
+
+// method: adds a member function method, the member pointer is kept in an
+// upvalue and called on the type checked self
+////////////////////////////////////////////////////////////////////////////////
+template <class T>
+inline LuaClass<T>& LuaClass<T>::method(const char* name, Method m) {
+  pushMethods();
+  void* p = luawrapper_detail::newUserdata(m_luastate, sizeof(Method));
+  memcpy(p, &m, sizeof(Method));
+  lua_pushcclosure(m_luastate, &LuaClass<T>::callMethod, 1);
+  lua_setfield(m_luastate, -2, name);
+  lua_pop(m_luastate, 1);
+  return *this;
+}
+
+// constructor: adds a function constructing T from lua arguments
+////////////////////////////////////////////////////////////////////////////////
+template <class T>
+template <class... Args>
+inline LuaClass<T>& LuaClass<T>::constructor(const char* name) {
+  pushMethods();
+  lua_pushcfunction(m_luastate, &LuaClass<T>::template construct<Args...>);
+  lua_setfield(m_luastate, -2, name);
+  lua_pop(m_luastate, 1);
+  return *this;
+}
+
+// push: creates userdata, constructs T in it and sets the class metatable.
+// The metatable is looked up first, so a failed lookup leaves no T behind.
+////////////////////////////////////////////////////////////////////////////////
+template <class T>
+template <class... Args>
+inline T* LuaClass<T>::push(lua_State* L, Args&&... args) {
+  if (lua_rawgetp(L, LUA_REGISTRYINDEX, &tag) != LUA_TTABLE)
+    luaL_error(L, "ERROR: C++ class not registered in this lua state!");
+  void* mem = luawrapper_detail::newUserdata(L, sizeof(T));
+  T* obj = new (mem) T(std::forward<Args>(args)...);
+  lua_insert(L, -2);
+  lua_setmetatable(L, -2);
+  return obj;
+}
+
+// check: returns object at index, raising an error for any other value
+////////////////////////////////////////////////////////////////////////////////
+template <class T>
+inline T* LuaClass<T>::check(lua_State* L, int index) {
+  T* obj = test(L, index);
+  if (!obj) {
+    const char* name = "object";
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &tag) == LUA_TTABLE) {
+      lua_getfield(L, -1, "__name");
+      if (lua_isstring(L, -1))
+        name = lua_tostring(L, -1);
+    }
+    luaL_argerror(L, index, lua_pushfstring(L, "%s expected, got %s", name,
+                                            luaL_typename(L, index)));
+  }
+  return obj;
+}
+
+// test: compares the metatable of value at index with the class metatable
+////////////////////////////////////////////////////////////////////////////////
+template <class T>
+inline T* LuaClass<T>::test(lua_State* L, int index) {
+  void* p = lua_touserdata(L, index);
+  if (!p || lua_islightuserdata(L, index) || !lua_getmetatable(L, index))
+    return NULL;
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &tag);
+  bool same = lua_rawequal(L, -1, -2) != 0;
+  lua_pop(L, 2);
+  return same ? (T*)p : NULL;
+}
+
+// pushMethods: pushes the methods table (__index of the metatable)
+////////////////////////////////////////////////////////////////////////////////
+template <class T>
+inline void LuaClass<T>::pushMethods() {
+  lua_rawgetp(m_luastate, LUA_REGISTRYINDEX, &tag);
+  lua_getfield(m_luastate, -1, "__index");
+  lua_remove(m_luastate, -2);
+}
+
+// gc: runs the destructor of the object in the userdata
+////////////////////////////////////////////////////////////////////////////////
+template <class T>
+inline int LuaClass<T>::gc(lua_State* L) {
+  T* obj = test(L, 1);
+  if (obj)
+    obj->~T();
+  return 0;
+}
+
+// callMethod: dispatches to the member function stored in the upvalue
+////////////////////////////////////////////////////////////////////////////////
+template <class T>
+inline int LuaClass<T>::callMethod(lua_State* L) {
+  T* self = check(L, 1);
+  Method m;
+  memcpy(&m, lua_touserdata(L, lua_upvalueindex(1)), sizeof(Method));
+  return (self->*m)(L);
+}
+
+// construct: reads constructor arguments from the stack and pushes a new T
+////////////////////////////////////////////////////////////////////////////////
+template <class T>
+template <class... Args, int... I>
+inline int LuaClass<T>::construct(lua_State* L,
+                                  luawrapper_detail::Indices<I...> indices) {
+  luawrapper_detail::checkArgs<Args...>(L, indices);
+  push(L, LuaStack<typename std::decay<Args>::type>::to(L, I + 1)...);
+  return 1;
+}
+
+template <class T>
+template <class... Args>
+inline int LuaClass<T>::construct(lua_State* L) {
+  return construct<Args...>(
+    L, typename luawrapper_detail::MakeIndices<sizeof...(Args)>::type());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// LuaStatePool
+////////////////////////////////////////////////////////////////////////////////
+
+// LuaStatePool: owns a fixed set of fully initialized LuaWrapper states (libs
+// and commands already opened) and hands them out through RAII leases, so
+// worker threads run scripts on their own state instead of sharing the
+// singleton. Hold a lease for a thread's lifetime for per-thread states, or
+// check one out per request. All leases must be returned before the pool is
+// destroyed.
+class LuaStatePool {
+
+public:
+  struct Stats {
+    unsigned long long checkouts;   // number of successful checkouts
+    unsigned long long contended;   // checkouts that had to wait for a state
+    unsigned long long totalWaitNs; // accumulated checkout wait time
+    unsigned long long maxWaitNs;   // longest single checkout wait
+  };
+
+  // Lease: checked out state, returned to the pool when it goes out of scope
+  class Lease {
+  public:
+    Lease() : m_pool(NULL), m_wrapper(NULL) {}
+    Lease(Lease&& other)
+    : m_pool(other.m_pool), m_wrapper(other.m_wrapper) {
+      other.m_pool    = NULL;
+      other.m_wrapper = NULL;
+    }
+    Lease& operator=(Lease&& other) {
+      if (this != &other) {
+        release();
+        m_pool    = other.m_pool;
+        m_wrapper = other.m_wrapper;
+        other.m_pool    = NULL;
+        other.m_wrapper = NULL;
+      }
+      return *this;
+    }
+    ~Lease() { release(); }
+
+    Lease(const Lease&) = delete;
+    Lease& operator=(const Lease&) = delete;
+
+    LuaWrapper* operator->() const { return m_wrapper; }
+    LuaWrapper& operator*() const  { return *m_wrapper; }
+    LuaWrapper* get() const        { return m_wrapper; }
+    explicit operator bool() const { return m_wrapper != NULL; }
+
+    // returns the state to the pool before the end of scope
+    void release() {
+      if (m_wrapper)
+        m_pool->checkin(m_wrapper);
+      m_pool    = NULL;
+      m_wrapper = NULL;
+    }
+
+  private:
+    friend class LuaStatePool;
+    Lease(LuaStatePool* pool, LuaWrapper* wrapper)
+    : m_pool(pool), m_wrapper(wrapper) {}
+
+    LuaStatePool* m_pool;
+    LuaWrapper*   m_wrapper;
+  };
+
+  // @brief creates nstates states, one per hardware thread if nstates is 0,
+  // each limited to memlimit bytes unless memlimit is 0.
+  explicit LuaStatePool(size_t nstates = 0, size_t memlimit = 0);
+
+  // @brief destructor, closes every state owned by the pool.
+  ~LuaStatePool();
+
+  LuaStatePool(const LuaStatePool&) = delete;
+  LuaStatePool& operator=(const LuaStatePool&) = delete;
+
+  Lease  checkout();    // blocks until a state is available
+  Lease  tryCheckout(); // returns an empty lease if no state is available
+  size_t size() const { return m_states.size(); }
+  size_t available();
+  Stats  stats();
+
+private:
+  void checkin(LuaWrapper* wrapper);
+
+  std::vector<LuaWrapper*> m_states; // all states, owned by the pool
+  std::vector<LuaWrapper*> m_free;   // states currently not checked out
+  std::mutex               m_mutex;
+  std::condition_variable  m_cond;
+  Stats                    m_stats;
+};
+
+// Constructor - creates and initializes all states up front so checkout never
+// pays for luaL_openlibs or luaopen_commands
+////////////////////////////////////////////////////////////////////////////////
+inline LuaStatePool::LuaStatePool(size_t nstates, size_t memlimit) {
+  if (nstates == 0)
+    nstates = std::thread::hardware_concurrency();
+  if (nstates == 0)
+    nstates = 1;
+
+  memset(&m_stats, 0, sizeof(m_stats));
+  m_states.reserve(nstates);
+  m_free.reserve(nstates);
+  for (size_t i = 0; i < nstates; i++) {
+    LuaWrapper* wrapper = new LuaWrapper(memlimit);
+    m_states.push_back(wrapper);
+    m_free.push_back(wrapper);
+  }
+}
+
+// Destructor - closes all states, leases must have been returned
+////////////////////////////////////////////////////////////////////////////////
+inline LuaStatePool::~LuaStatePool() {
+  for (size_t i = 0; i < m_states.size(); i++)
+    delete m_states[i];
+}
+
+// checkout: waits for a free state and leases it to the caller, accounting
+// for the time spent waiting
+////////////////////////////////////////////////////////////////////////////////
+inline LuaStatePool::Lease LuaStatePool::checkout() {
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  bool waited = m_free.empty();
+  while (m_free.empty())
+    m_cond.wait(lock);
+
+  LuaWrapper* wrapper = m_free.back();
+  m_free.pop_back();
+
+  unsigned long long waitns = (unsigned long long)
+    std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count();
+  m_stats.checkouts++;
+  m_stats.totalWaitNs += waitns;
+  if (waited)
+    m_stats.contended++;
+  if (waitns > m_stats.maxWaitNs)
+    m_stats.maxWaitNs = waitns;
+
+  return Lease(this, wrapper);
+}
+
+// tryCheckout: leases a free state without waiting, the returned lease is
+// empty if all states are in use
+////////////////////////////////////////////////////////////////////////////////
+inline LuaStatePool::Lease LuaStatePool::tryCheckout() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (m_free.empty())
+    return Lease();
+
+  LuaWrapper* wrapper = m_free.back();
+  m_free.pop_back();
+  m_stats.checkouts++;
+
+  return Lease(this, wrapper);
+}
+
+// available: number of states not currently leased
+////////////////////////////////////////////////////////////////////////////////
+inline size_t LuaStatePool::available() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_free.size();
+}
+
+// stats: returns a copy of the checkout statistics
+////////////////////////////////////////////////////////////////////////////////
+inline LuaStatePool::Stats LuaStatePool::stats() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_stats;
+}
+
+// checkin: clears whatever the lease holder left on the stack and returns the
+// state to the free list
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaStatePool::checkin(LuaWrapper* wrapper) {
+  lua_settop(wrapper->getLuaState(), 0);
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_free.push_back(wrapper);
+  }
+  m_cond.notify_one();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Allocators for LuaWrapper(lua_Alloc, void*). An allocator object serves a
+// single state and is not thread safe, which is what removes the contention
+// of the shared malloc heap. It must outlive the state using it.
+////////////////////////////////////////////////////////////////////////////////
+
+struct LuaAllocStats {
+  size_t             bytesInUse; // bytes currently allocated by lua
+  size_t             peakBytes;  // highest bytesInUse seen
+  unsigned long long allocCount; // allocation and reallocation requests
+};
+
+// LuaPoolAllocator: segregated free lists for blocks up to MAX_SMALL bytes in
+// GRANULE steps, which covers most strings, tables and closures. Lua passes
+// the old block size to the allocator so blocks carry no header. Bigger
+// blocks go to realloc.
+class LuaPoolAllocator {
+
+public:
+  enum {
+    GRANULE    = 16,
+    MAX_SMALL  = 512,
+    NCLASSES   = MAX_SMALL / GRANULE,
+    PAGE_BYTES = 16 * 1024
+  };
+
+  LuaPoolAllocator() {
+    memset(&m_stats, 0, sizeof(m_stats));
+    memset(m_freelists, 0, sizeof(m_freelists));
+  }
+  ~LuaPoolAllocator() {
+    for (size_t i = 0; i < m_pages.size(); i++)
+      ::free(m_pages[i]);
+  }
+
+  LuaPoolAllocator(const LuaPoolAllocator&) = delete;
+  LuaPoolAllocator& operator=(const LuaPoolAllocator&) = delete;
+
+  // lua_Alloc entry point, pass the allocator object as ud
+  static void* alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+
+  const LuaAllocStats& stats() const { return m_stats; }
+
+private:
+  struct FreeBlock { FreeBlock* next; };
+
+  static int sizeClass(size_t size) {
+    return size > MAX_SMALL ? -1 : (int)((size + GRANULE - 1) / GRANULE) - 1;
+  }
+
+  void* allocSmall(int cls);
+  void  freeSmall(void* p, int cls);
+  void  refill(int cls);
+
+  FreeBlock*         m_freelists[NCLASSES];
+  std::vector<void*> m_pages;
+  LuaAllocStats      m_stats;
+};
+
+// alloc: lua_Alloc implementation, ptr is NULL when allocating a new block, in
+// which case osize holds the object type and not a size
+////////////////////////////////////////////////////////////////////////////////
+inline void* LuaPoolAllocator::alloc(void* ud, void* ptr, size_t osize,
+                                     size_t nsize) {
+  LuaPoolAllocator* self = (LuaPoolAllocator*)ud;
+  if (ptr == NULL)
+    osize = 0;
+  int ocls = ptr ? sizeClass(osize) : -1;
+
+  if (nsize == 0) {
+    if (ptr) {
+      if (ocls >= 0)
+        self->freeSmall(ptr, ocls);
+      else
+        ::free(ptr);
+      self->m_stats.bytesInUse -= osize;
+    }
+    return NULL;
+  }
+
+  int ncls = sizeClass(nsize);
+  void* block;
+  if (ptr && ocls == ncls && ncls >= 0) {
+    block = ptr; // same size class, nothing to move
+  } else if (ocls < 0 && ncls < 0) {
+    block = ::realloc(ptr, nsize);
+    if (!block)
+      return NULL;
+  } else {
+    block = ncls >= 0 ? self->allocSmall(ncls) : ::malloc(nsize);
+    if (!block)
+      return NULL;
+    if (ptr) {
+      memcpy(block, ptr, osize < nsize ? osize : nsize);
+      if (ocls >= 0)
+        self->freeSmall(ptr, ocls);
+      else
+        ::free(ptr);
+    }
+  }
+
+  self->m_stats.allocCount++;
+  self->m_stats.bytesInUse += nsize - osize;
+  if (self->m_stats.bytesInUse > self->m_stats.peakBytes)
+    self->m_stats.peakBytes = self->m_stats.bytesInUse;
+  return block;
+}
+
+// allocSmall: pops a block of size class cls, refilling its list if empty
+////////////////////////////////////////////////////////////////////////////////
+inline void* LuaPoolAllocator::allocSmall(int cls) {
+  if (!m_freelists[cls])
+    refill(cls);
+  FreeBlock* block = m_freelists[cls];
+  if (block)
+    m_freelists[cls] = block->next;
+  return block;
+}
+
+// freeSmall: pushes a block back to the list of its size class
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaPoolAllocator::freeSmall(void* p, int cls) {
+  FreeBlock* block = (FreeBlock*)p;
+  block->next = m_freelists[cls];
+  m_freelists[cls] = block;
+}
+
+// refill: carves a new page into blocks of size class cls
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaPoolAllocator::refill(int cls) {
+  char* page = (char*)::malloc(PAGE_BYTES);
+  if (!page)
+    return;
+  m_pages.push_back(page);
+
+  size_t size = (size_t)(cls + 1) * GRANULE;
+  for (size_t off = 0; off + size <= PAGE_BYTES; off += size)
+    freeSmall(page + off, cls);
+}
+
+// LuaArenaAllocator: bump allocator for short lived request states. Frees only
+// give memory back when they release the last block, everything else is
+// reclaimed at once by reset() after the state is closed.
+class LuaArenaAllocator {
+
+public:
+  enum { ALIGN = 16 };
+
+  explicit LuaArenaAllocator(size_t blocksize = 256 * 1024)
+  : m_blocksize(blocksize), m_current(0), m_top(NULL), m_end(NULL),
+    m_last(NULL) {
+    memset(&m_stats, 0, sizeof(m_stats));
+  }
+  ~LuaArenaAllocator() {
+    for (size_t i = 0; i < m_blocks.size(); i++)
+      ::free(m_blocks[i].base);
+  }
+
+  LuaArenaAllocator(const LuaArenaAllocator&) = delete;
+  LuaArenaAllocator& operator=(const LuaArenaAllocator&) = delete;
+
+  // lua_Alloc entry point, pass the allocator object as ud
+  static void* alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+
+  // rewinds the arena keeping its blocks, only after lua_close of the state
+  void reset();
+
+  const LuaAllocStats& stats() const { return m_stats; }
+
+private:
+  struct Block {
+    char*  base;
+    size_t size;
+  };
+
+  static size_t aligned(size_t n) {
+    return (n + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+  }
+
+  void* bump(size_t nsize);
+
+  size_t             m_blocksize;
+  std::vector<Block> m_blocks;
+  size_t             m_current; // index of the block being bumped
+  char*              m_top;     // next free byte in current block
+  char*              m_end;     // end of current block
+  char*              m_last;    // start of the most recent allocation
+  LuaAllocStats      m_stats;
+};
+
+// alloc: lua_Alloc implementation, the most recent block is grown, shrunk and
+// freed in place, other frees are deferred to reset()
+////////////////////////////////////////////////////////////////////////////////
+inline void* LuaArenaAllocator::alloc(void* ud, void* ptr, size_t osize,
+                                      size_t nsize) {
+  LuaArenaAllocator* self = (LuaArenaAllocator*)ud;
+  if (ptr == NULL)
+    osize = 0;
+
+  void* block = ptr;
+  if (nsize == 0) {
+    if (ptr && (char*)ptr == self->m_last) {
+      self->m_top  = self->m_last;
+      self->m_last = NULL;
+    }
+    block = NULL;
+  } else if (ptr && (char*)ptr == self->m_last &&
+             self->m_last + aligned(nsize) <= self->m_end) {
+    self->m_top = self->m_last + aligned(nsize); // resize last block in place
+  } else if (nsize > osize) {
+    block = self->bump(nsize);
+    if (!block)
+      return NULL;
+    if (ptr)
+      memcpy(block, ptr, osize);
+  } // shrinking any other block keeps it where it is
+
+  if (nsize > 0)
+    self->m_stats.allocCount++;
+  self->m_stats.bytesInUse += nsize - osize;
+  if (self->m_stats.bytesInUse > self->m_stats.peakBytes)
+    self->m_stats.peakBytes = self->m_stats.bytesInUse;
+  return block;
+}
+
+// bump: carves nsize bytes from the current block, moving on to the next
+// (possibly new) block when it does not fit
+////////////////////////////////////////////////////////////////////////////////
+inline void* LuaArenaAllocator::bump(size_t nsize) {
+  size_t size = aligned(nsize);
+  while (m_top == NULL || m_top + size > m_end) {
+    size_t next = m_top == NULL ? 0 : m_current + 1;
+    if (next >= m_blocks.size()) {
+      Block b;
+      b.size = size > m_blocksize ? size : m_blocksize;
+      b.base = (char*)::malloc(b.size);
+      if (!b.base)
+        return NULL;
+      m_blocks.push_back(b);
+    }
+    if (m_blocks[next].size < size) {
+      // reused block too small for this request, skip it
+      m_current = next;
+      m_top = m_end = m_blocks[next].base + m_blocks[next].size;
+      continue;
+    }
+    m_current = next;
+    m_top = m_blocks[next].base;
+    m_end = m_top + m_blocks[next].size;
+  }
+  m_last = m_top;
+  m_top += size;
+  return m_last;
+}
+
+// reset: makes all blocks available again
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaArenaAllocator::reset() {
+  m_current = 0;
+  m_top = m_end = m_last = NULL;
+  m_stats.bytesInUse = 0;
+}
+
 #endif // LUAWRAPPER_HPP header guard
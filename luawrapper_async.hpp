@@ -0,0 +1,782 @@
+/*******************************************************************************
+  url/git: http://fpaboim.github.com/luawrapper
+  Distributed under the MIT License.
+
+  Asynchronous I/O for LuaWrapper scripts on Linux. LuaScheduler runs script
+  entry points as coroutines (lua_newthread + lua_resume) and registers an
+  "async" table with read, write, accept and close primitives. A primitive
+  that cannot complete at once submits the operation and yields, the
+  scheduler resumes the coroutine with the results when the operation
+  completes, so one lua state overlaps any number of in-flight operations:
+
+    luaWrap.doFile("server.lua");
+    LuaScheduler sched(luaWrap);
+    sched.spawn("serve", listenfd);   -- function serve(fd) ... async.accept(fd)
+    sched.run();
+
+  Completions come from io_uring, driven through raw syscalls so no liburing
+  is needed, or from an epoll readiness loop when io_uring is unavailable
+  (old kernel, seccomp). In epoll mode descriptors are switched to
+  non-blocking, only one operation may be pending per descriptor (a second
+  one raises an error), regular files complete synchronously, and
+  descriptors should be closed with async.close. The primitives can only be
+  called from coroutines started by spawn, not from coroutines a script
+  creates itself.
+*******************************************************************************/
+#ifndef LUAWRAPPER_ASYNC_HPP
+#define LUAWRAPPER_ASYNC_HPP
+
+#ifndef __linux__
+#error "luawrapper_async.hpp requires Linux (io_uring or epoll)"
+#endif
+
+// includes
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include "luawrapper.hpp"
+
+class LuaScheduler {
+
+public:
+  // @brief sets up io_uring with "entries" submission slots (epoll if that
+  // fails) and registers the async table in the wrapper's state.
+  explicit LuaScheduler(LuaWrapper& lw, unsigned entries = 256);
+
+  // @brief destructor, coroutines still suspended are abandoned once their
+  // in-flight operations are cancelled and drained.
+  ~LuaScheduler();
+
+  LuaScheduler(const LuaScheduler&) = delete;
+  LuaScheduler& operator=(const LuaScheduler&) = delete;
+
+  // Starts global function "entry" with args as a new coroutine and runs it
+  // until its first yield. Returns false if the entry point failed, see
+  // lastError.
+  template <class... Args>
+  bool spawn( const char* entry, Args&&... args );
+
+  void   run();            // runs until every coroutine has finished
+  bool   step(bool wait);  // handles completions once, false if idle
+  size_t coroutines() const { return m_threads.size(); }
+  // error of the last coroutine that failed
+  const LuaError& lastError() const { return m_lasterror; }
+  bool   usingIoUring() const { return m_ring.fd >= 0; }
+
+private:
+  struct Op {
+    enum Kind { READ, WRITE, ACCEPT };
+    Kind              kind;
+    int               fd;
+    lua_State*        co;
+    const char*       data; // write source, anchored on the coroutine stack
+    size_t            len;
+    std::vector<char> buf;  // read destination
+    Op*               prev; // in-flight list, see m_ops
+    Op*               next;
+  };
+
+  // io_uring rings mapped from the kernel
+  struct Ring {
+    int           fd;
+    unsigned*     sqhead;
+    unsigned*     sqtail;
+    unsigned*     sqmask;
+    unsigned*     sqarray;
+    unsigned*     cqhead;
+    unsigned*     cqtail;
+    unsigned*     cqmask;
+    io_uring_sqe* sqes;
+    io_uring_cqe* cqes;
+    void*         sqptr;
+    size_t        sqsize;
+    void*         cqptr;
+    size_t        cqsize;
+    size_t        sqessize;
+    unsigned      sqentries;
+    unsigned      tosubmit;
+  };
+
+  // bytes moved by one read or write, the result still fits an int and the
+  // 32 bit length of an SQE
+  enum { MAX_IO = 1 << 30 };
+
+  // lua primitives, a userdata box holding the scheduler is the first upvalue
+  static int luaRead(lua_State* L);
+  static int luaWrite(lua_State* L);
+  static int luaAccept(lua_State* L);
+  static int luaClose(lua_State* L);
+  static LuaScheduler* self(lua_State* L);
+  static Op* newOp(Op::Kind kind, int fd, size_t len);
+  void checkCaller(lua_State* L, int fd);
+  int  start(lua_State* L, Op* op);
+
+  bool resume(lua_State* co, int nargs);
+  void complete(Op* op, int res);
+  int  pushResults(Op* op, int res);
+  void finish(lua_State* co);
+  void link(Op* op);
+  void unlink(Op* op);
+  void cancelAll();
+
+  bool ringSetup(unsigned entries);
+  void ringClose();
+  io_uring_sqe* ringSqe();
+  void ringQueue();
+  bool ringSubmit(Op* op);
+  bool ringCancel(Op* op);
+  int  ringEnter(unsigned minComplete);
+  void ringReap();
+  bool ringDrain();
+
+  int  tryNow(Op* op);
+  bool epollArm(Op* op);
+  void epollWait(bool wait);
+
+  LuaWrapper&                            m_wrapper;
+  Ring                                   m_ring;
+  int                                    m_epfd;
+  std::unordered_set<int>                m_registered; // fds known to epoll
+  std::unordered_set<int>                m_pending;    // fds armed in epoll
+  std::unordered_map<lua_State*, LuaRef> m_threads;    // anchored coroutines
+  std::deque<lua_State*>                 m_ready;      // plain yields
+  size_t                                 m_inflight;
+  Op*                                    m_ops;        // in flight
+  bool                                   m_ioyield;    // set by primitives
+  LuaError                               m_lasterror;
+  LuaScheduler**                         m_box;        // primitives' upvalue
+  LuaRef                                 m_boxref;     // keeps the box alive
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Constructor - prefers io_uring and falls back to epoll, then registers the
+// async primitives with the scheduler as upvalue
+inline LuaScheduler::LuaScheduler(LuaWrapper& lw, unsigned entries)
+: m_wrapper(lw),
+  m_epfd(-1),
+  m_inflight(0),
+  m_ops(NULL),
+  m_ioyield(false),
+  m_box(NULL)
+{
+  memset(&m_ring, 0, sizeof(m_ring));
+  m_ring.fd = -1;
+  if (!ringSetup(entries))
+    m_epfd = epoll_create1(EPOLL_CLOEXEC);
+
+  static const luaL_Reg funcs[] = {
+    { "read",   &LuaScheduler::luaRead },
+    { "write",  &LuaScheduler::luaWrite },
+    { "accept", &LuaScheduler::luaAccept },
+    { "close",  &LuaScheduler::luaClose },
+    { NULL, NULL }
+  };
+  lua_State* L = m_wrapper.getLuaState();
+  lua_newtable(L);
+  m_box  = (LuaScheduler**)luawrapper_detail::newUserdata(
+    L, sizeof(LuaScheduler*));
+  *m_box = this;
+  lua_pushvalue(L, -1);
+  m_boxref = m_wrapper.pop2LuaRef();
+  luaL_setfuncs(L, funcs, 1);
+  lua_setglobal(L, "async");
+}
+
+// Destructor - releases the rings or epoll descriptor. The async global is
+// removed and primitives the scripts kept a reference to raise an error.
+// In-flight operations are cancelled first: their SQEs point into the Ops
+// and into strings anchored by the coroutines released after them.
+inline LuaScheduler::~LuaScheduler() {
+  lua_State* L = m_wrapper.getLuaState();
+  lua_pushnil(L);
+  lua_setglobal(L, "async");
+  *m_box = NULL;
+  m_boxref.release();
+  cancelAll();
+  m_threads.clear();
+  m_lasterror.clear();
+  ringClose();
+  if (m_epfd >= 0)
+    close(m_epfd);
+}
+
+// spawn: creates an anchored coroutine for the entry point and starts it
+////////////////////////////////////////////////////////////////////////////////
+template <class... Args>
+inline bool LuaScheduler::spawn( const char* entry, Args&&... args ) {
+  lua_State* L  = m_wrapper.getLuaState();
+  lua_State* co = lua_newthread(L);
+  m_threads.insert(std::make_pair(co, m_wrapper.pop2LuaRef()));
+
+  lua_getglobal(co, entry);
+  luawrapper_detail::pushAll(co, std::forward<Args>(args)...);
+  return resume(co, (int)sizeof...(Args));
+}
+
+// run: resumes coroutines as their operations complete until none is left
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaScheduler::run() {
+  while (!m_threads.empty() && step(true)) {}
+}
+
+// step: resumes coroutines that yielded without I/O, then handles completed
+// operations, blocking for at least one if wait is set and nothing is ready
+////////////////////////////////////////////////////////////////////////////////
+inline bool LuaScheduler::step(bool wait) {
+  size_t nready = m_ready.size();
+  for (size_t i = 0; i < nready; i++) {
+    lua_State* co = m_ready.front();
+    m_ready.pop_front();
+    resume(co, 0);
+  }
+
+  if (m_inflight == 0 && (!usingIoUring() || m_ring.tosubmit == 0))
+    return !m_ready.empty(); // nothing pending, suspended threads never wake
+
+  wait = wait && m_ready.empty();
+  if (usingIoUring()) {
+    ringEnter(wait ? 1 : 0);
+    ringReap();
+  } else {
+    epollWait(wait);
+  }
+  return true;
+}
+
+// resume: resumes co with nargs values on its stack and handles the outcome,
+// coroutines that finish or fail are released
+////////////////////////////////////////////////////////////////////////////////
+inline bool LuaScheduler::resume(lua_State* co, int nargs) {
+  m_ioyield = false;
+  m_wrapper.armThread(co);
+#if LUA_VERSION_NUM >= 504
+  int nres = 0;
+  int ret  = lua_resume(co, m_wrapper.getLuaState(), nargs, &nres);
+#else
+  int ret  = lua_resume(co, m_wrapper.getLuaState(), nargs);
+  int nres = lua_gettop(co);
+#endif
+  if (ret == LUA_YIELD) {
+    lua_pop(co, nres);
+    if (!m_ioyield)
+      m_ready.push_back(co); // coroutine.yield, resume on the next step
+    return true;
+  }
+  if (ret != LUA_OK)
+    m_wrapper.threadError(m_lasterror, co, ret);
+  finish(co);
+  return ret == LUA_OK;
+}
+
+// finish: drops the registry anchor of a finished coroutine
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaScheduler::finish(lua_State* co) {
+  m_threads.erase(co);
+}
+
+// self: scheduler boxed as upvalue of the primitives, errors once the
+// scheduler has been destroyed
+////////////////////////////////////////////////////////////////////////////////
+inline LuaScheduler* LuaScheduler::self(lua_State* L) {
+  LuaScheduler* s =
+    *(LuaScheduler**)lua_touserdata(L, lua_upvalueindex(1));
+  if (!s)
+    luaL_error(L, "ERROR: async scheduler no longer exists!");
+  return s;
+}
+
+// newOp: allocates an operation with a len byte read buffer for READ, NULL if
+// memory is exhausted. Nothing may throw through the lua frames above.
+////////////////////////////////////////////////////////////////////////////////
+inline LuaScheduler::Op* LuaScheduler::newOp(Op::Kind kind, int fd,
+                                             size_t len) {
+  try {
+    std::unique_ptr<Op> op(new Op());
+    op->kind = kind;
+    op->fd   = fd;
+    op->co   = NULL;
+    op->data = NULL;
+    op->len  = len;
+    op->prev = NULL;
+    op->next = NULL;
+    if (kind == Op::READ)
+      op->buf.resize(len ? len : 1);
+    return op.release();
+  } catch (const std::bad_alloc&) {
+    return NULL;
+  }
+}
+
+// checkCaller: raises an error unless L is a coroutine started by spawn that
+// can yield, and, in epoll mode, fd has no operation pending already
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaScheduler::checkCaller(lua_State* L, int fd) {
+  // a coroutine created by the script would yield to its lua resumer
+  if (!lua_isyieldable(L) || !m_threads.count(L))
+    luaL_error(L, "ERROR: async I/O outside a scheduler coroutine!");
+  if (m_pending.count(fd))
+    luaL_error(L, "ERROR: descriptor %d already has a pending operation!",
+               fd);
+}
+
+// luaRead: async.read(fd, n) returns up to n bytes (at most MAX_IO), "" at
+// end of file, or nil and an error message
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaScheduler::luaRead(lua_State* L) {
+  LuaScheduler* s = self(L);
+  int         fd  = (int)luaL_checkinteger(L, 1);
+  lua_Integer n   = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, n >= 0, 2, "negative length");
+  s->checkCaller(L, fd);
+  Op* op = newOp(Op::READ, fd, n > MAX_IO ? (size_t)MAX_IO : (size_t)n);
+  if (!op)
+    return luaL_error(L, "ERROR: not enough memory for async.read!");
+  return s->start(L, op);
+}
+
+// luaWrite: async.write(fd, s) returns the number of bytes written, at most
+// MAX_IO, or nil and an error message
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaScheduler::luaWrite(lua_State* L) {
+  LuaScheduler* s = self(L);
+  size_t      len = 0;
+  int         fd  = (int)luaL_checkinteger(L, 1);
+  const char* str = luaL_checklstring(L, 2, &len);
+  s->checkCaller(L, fd);
+  Op* op = newOp(Op::WRITE, fd, len > MAX_IO ? (size_t)MAX_IO : len);
+  if (!op)
+    return luaL_error(L, "ERROR: not enough memory for async.write!");
+  op->data = str;
+  return s->start(L, op);
+}
+
+// luaAccept: async.accept(fd) returns the accepted descriptor, or nil and an
+// error message
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaScheduler::luaAccept(lua_State* L) {
+  LuaScheduler* s = self(L);
+  int fd = (int)luaL_checkinteger(L, 1);
+  s->checkCaller(L, fd);
+  Op* op = newOp(Op::ACCEPT, fd, 0);
+  if (!op)
+    return luaL_error(L, "ERROR: not enough memory for async.accept!");
+  return s->start(L, op);
+}
+
+// luaClose: async.close(fd) closes the descriptor and forgets its epoll state
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaScheduler::luaClose(lua_State* L) {
+  LuaScheduler* s = self(L);
+  int fd = (int)luaL_checkinteger(L, 1);
+  s->m_registered.erase(fd);
+  lua_pushboolean(L, close(fd) == 0);
+  return 1;
+}
+
+// start: submits op for the calling coroutine, checked by checkCaller, and
+// yields. Operations that complete immediately in epoll mode return their
+// results without yielding.
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaScheduler::start(lua_State* L, Op* op) {
+  op->co = L;
+  if (usingIoUring()) {
+    if (!ringSubmit(op)) {
+      delete op;
+      return luaL_error(L, "ERROR: io_uring submission failed!");
+    }
+  } else {
+    int res = tryNow(op);
+    if (res != -EAGAIN || !epollArm(op)) {
+      int nres = pushResults(op, res);
+      delete op;
+      return nres;
+    }
+    m_pending.insert(op->fd);
+  }
+
+  link(op);
+  m_inflight++;
+  m_ioyield = true;
+  return lua_yield(L, 0);
+}
+
+// complete: pushes the results of a finished operation and resumes its
+// coroutine, the values become the results of the yielding primitive
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaScheduler::complete(Op* op, int res) {
+  unlink(op);
+  m_inflight--;
+  m_pending.erase(op->fd);
+  lua_State* co = op->co;
+  int nres = pushResults(op, res);
+  delete op;
+  resume(co, nres);
+}
+
+// link: adds op to the in-flight list
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaScheduler::link(Op* op) {
+  op->prev = NULL;
+  op->next = m_ops;
+  if (m_ops)
+    m_ops->prev = op;
+  m_ops = op;
+}
+
+// unlink: removes op from the in-flight list
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaScheduler::unlink(Op* op) {
+  if (op->prev)
+    op->prev->next = op->next;
+  else
+    m_ops = op->next;
+  if (op->next)
+    op->next->prev = op->prev;
+  op->prev = op->next = NULL;
+}
+
+// cancelAll: frees every in-flight operation without resuming its
+// coroutine. io_uring operations are cancelled and drained first, so the
+// kernel no longer touches their buffers; if the ring fails meanwhile the
+// rest are leaked instead. epoll operations are only performed by epollWait.
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaScheduler::cancelAll() {
+  if (usingIoUring()) {
+    for (Op* op = m_ops; op; op = op->next) {
+      if (!ringCancel(op))
+        break; // the drain below still waits for every completion
+    }
+    if (!ringDrain())
+      m_ops = NULL;
+  }
+  while (m_ops) {
+    Op* op = m_ops;
+    unlink(op);
+    delete op;
+    m_inflight--;
+  }
+  m_pending.clear();
+}
+
+// pushResults: converts a syscall style result (negative errno on failure)
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaScheduler::pushResults(Op* op, int res) {
+  lua_State* L = op->co;
+  if (res < 0) {
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(-res));
+    return 2;
+  }
+  if (op->kind == Op::READ)
+    lua_pushlstring(L, op->buf.data(), (size_t)res);
+  else
+    lua_pushinteger(L, res);
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// io_uring backend
+////////////////////////////////////////////////////////////////////////////////
+
+// ringSetup: creates the ring and maps its queues, false if io_uring is not
+// usable (no syscall, no permission, or kernel without current position reads)
+////////////////////////////////////////////////////////////////////////////////
+inline bool LuaScheduler::ringSetup(unsigned entries) {
+#ifdef __NR_io_uring_setup
+  io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if (fd < 0)
+    return false;
+  if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+    close(fd);
+    return false;
+  }
+
+  m_ring.fd     = fd;
+  m_ring.sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  m_ring.cqsize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  bool single   = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && m_ring.cqsize > m_ring.sqsize)
+    m_ring.sqsize = m_ring.cqsize;
+
+  m_ring.sqptr = mmap(NULL, m_ring.sqsize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (m_ring.sqptr == MAP_FAILED) {
+    m_ring.sqptr = NULL;
+    ringClose();
+    return false;
+  }
+  if (single) {
+    m_ring.cqptr = m_ring.sqptr;
+  } else {
+    m_ring.cqptr = mmap(NULL, m_ring.cqsize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (m_ring.cqptr == MAP_FAILED) {
+      m_ring.cqptr = NULL;
+      ringClose();
+      return false;
+    }
+  }
+  m_ring.sqessize = p.sq_entries * sizeof(io_uring_sqe);
+  m_ring.sqes = (io_uring_sqe*)mmap(NULL, m_ring.sqessize,
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, fd,
+                                    IORING_OFF_SQES);
+  if (m_ring.sqes == MAP_FAILED) {
+    m_ring.sqes = NULL;
+    ringClose();
+    return false;
+  }
+
+  char* sq = (char*)m_ring.sqptr;
+  char* cq = (char*)m_ring.cqptr;
+  m_ring.sqhead    = (unsigned*)(sq + p.sq_off.head);
+  m_ring.sqtail    = (unsigned*)(sq + p.sq_off.tail);
+  m_ring.sqmask    = (unsigned*)(sq + p.sq_off.ring_mask);
+  m_ring.sqarray   = (unsigned*)(sq + p.sq_off.array);
+  m_ring.cqhead    = (unsigned*)(cq + p.cq_off.head);
+  m_ring.cqtail    = (unsigned*)(cq + p.cq_off.tail);
+  m_ring.cqmask    = (unsigned*)(cq + p.cq_off.ring_mask);
+  m_ring.cqes      = (io_uring_cqe*)(cq + p.cq_off.cqes);
+  m_ring.sqentries = p.sq_entries;
+  return true;
+#else
+  (void)entries;
+  return false;
+#endif
+}
+
+// ringClose: unmaps the queues and closes the ring
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaScheduler::ringClose() {
+  if (m_ring.sqes)
+    munmap(m_ring.sqes, m_ring.sqessize);
+  if (m_ring.cqptr && m_ring.cqptr != m_ring.sqptr)
+    munmap(m_ring.cqptr, m_ring.cqsize);
+  if (m_ring.sqptr)
+    munmap(m_ring.sqptr, m_ring.sqsize);
+  if (m_ring.fd >= 0)
+    close(m_ring.fd);
+  memset(&m_ring, 0, sizeof(m_ring));
+  m_ring.fd = -1;
+}
+
+// ringSqe: the next free SQE, zeroed, submitting earlier entries first if the
+// queue is full. NULL if none frees up. Filled entries are published by
+// ringQueue and handed to the kernel in batches by ringEnter.
+////////////////////////////////////////////////////////////////////////////////
+inline io_uring_sqe* LuaScheduler::ringSqe() {
+  unsigned tail = *m_ring.sqtail;
+  unsigned head = __atomic_load_n(m_ring.sqhead, __ATOMIC_ACQUIRE);
+  if (tail - head >= m_ring.sqentries) {
+    if (ringEnter(0) < 0)
+      return NULL;
+    head = __atomic_load_n(m_ring.sqhead, __ATOMIC_ACQUIRE);
+    if (tail - head >= m_ring.sqentries)
+      return NULL;
+  }
+  io_uring_sqe* sqe = &m_ring.sqes[tail & *m_ring.sqmask];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+// ringQueue: publishes the SQE returned by the last ringSqe
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaScheduler::ringQueue() {
+  unsigned tail  = *m_ring.sqtail;
+  unsigned index = tail & *m_ring.sqmask;
+  m_ring.sqarray[index] = index;
+  __atomic_store_n(m_ring.sqtail, tail + 1, __ATOMIC_RELEASE);
+  m_ring.tosubmit++;
+}
+
+// ringSubmit: queues an SQE performing op
+////////////////////////////////////////////////////////////////////////////////
+inline bool LuaScheduler::ringSubmit(Op* op) {
+  io_uring_sqe* sqe = ringSqe();
+  if (!sqe)
+    return false;
+  sqe->fd        = op->fd;
+  sqe->user_data = (unsigned long long)(uintptr_t)op;
+  switch (op->kind) {
+    case Op::READ:
+      sqe->opcode = IORING_OP_READ;
+      sqe->addr   = (unsigned long long)(uintptr_t)op->buf.data();
+      sqe->len    = (unsigned)op->len;
+      sqe->off    = (unsigned long long)-1; // current file position
+      break;
+    case Op::WRITE:
+      sqe->opcode = IORING_OP_WRITE;
+      sqe->addr   = (unsigned long long)(uintptr_t)op->data;
+      sqe->len    = (unsigned)op->len;
+      sqe->off    = (unsigned long long)-1;
+      break;
+    case Op::ACCEPT:
+      sqe->opcode       = IORING_OP_ACCEPT;
+      sqe->accept_flags = SOCK_CLOEXEC;
+      break;
+  }
+  ringQueue();
+  return true;
+}
+
+// ringCancel: queues a cancellation of op, its own completion carries no
+// user data. op still completes, with -ECANCELED if it was cancelled.
+////////////////////////////////////////////////////////////////////////////////
+inline bool LuaScheduler::ringCancel(Op* op) {
+  io_uring_sqe* sqe = ringSqe();
+  if (!sqe)
+    return false;
+  sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+  sqe->fd        = -1;
+  sqe->addr      = (unsigned long long)(uintptr_t)op;
+  sqe->user_data = 0;
+  ringQueue();
+  return true;
+}
+
+// ringEnter: submits queued entries and optionally waits for completions
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaScheduler::ringEnter(unsigned minComplete) {
+#ifdef __NR_io_uring_enter
+  int ret;
+  do {
+    ret = (int)syscall(__NR_io_uring_enter, m_ring.fd, m_ring.tosubmit,
+                       minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0,
+                       NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+  if (ret > 0)
+    m_ring.tosubmit -= (unsigned)ret < m_ring.tosubmit ? (unsigned)ret
+                                                      : m_ring.tosubmit;
+  return ret;
+#else
+  (void)minComplete;
+  return -1;
+#endif
+}
+
+// ringReap: resumes the coroutine of every completed operation
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaScheduler::ringReap() {
+  unsigned head = *m_ring.cqhead;
+  for (;;) {
+    unsigned tail = __atomic_load_n(m_ring.cqtail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+      break;
+    io_uring_cqe* cqe = &m_ring.cqes[head & *m_ring.cqmask];
+    Op* op  = (Op*)(uintptr_t)cqe->user_data;
+    int res = cqe->res;
+    head++;
+    // release the slot before resuming, the coroutine may submit again
+    __atomic_store_n(m_ring.cqhead, head, __ATOMIC_RELEASE);
+    complete(op, res);
+  }
+}
+
+// ringDrain: waits until every in-flight operation has completed and frees
+// it, consuming the completions without resuming coroutines. False if the
+// ring failed first.
+////////////////////////////////////////////////////////////////////////////////
+inline bool LuaScheduler::ringDrain() {
+  while (m_ops) {
+    unsigned head = *m_ring.cqhead;
+    unsigned tail = __atomic_load_n(m_ring.cqtail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      if (ringEnter(1) < 0)
+        return false;
+      continue;
+    }
+    for (; head != tail; head++) {
+      io_uring_cqe* cqe = &m_ring.cqes[head & *m_ring.cqmask];
+      Op* op = (Op*)(uintptr_t)cqe->user_data;
+      if (op) {
+        unlink(op);
+        delete op;
+        m_inflight--;
+      }
+    }
+    __atomic_store_n(m_ring.cqhead, head, __ATOMIC_RELEASE);
+  }
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// epoll backend
+////////////////////////////////////////////////////////////////////////////////
+
+// tryNow: attempts the operation without blocking, returns the syscall result
+// or a negative errno (-EAGAIN if the descriptor is not ready)
+////////////////////////////////////////////////////////////////////////////////
+inline int LuaScheduler::tryNow(Op* op) {
+  if (!m_registered.count(op->fd)) {
+    int flags = fcntl(op->fd, F_GETFL);
+    if (flags >= 0 && !(flags & O_NONBLOCK))
+      fcntl(op->fd, F_SETFL, flags | O_NONBLOCK);
+  }
+
+  ssize_t res;
+  do {
+    switch (op->kind) {
+      case Op::READ:
+        res = read(op->fd, op->buf.data(), op->len);
+        break;
+      case Op::WRITE:
+        res = write(op->fd, op->data, op->len);
+        break;
+      default:
+        res = accept4(op->fd, NULL, NULL, SOCK_CLOEXEC);
+        break;
+    }
+  } while (res < 0 && errno == EINTR);
+
+  if (res < 0)
+    return errno == EWOULDBLOCK ? -EAGAIN : -errno;
+  return (int)res;
+}
+
+// epollArm: waits for readiness of op's descriptor with a one shot event
+////////////////////////////////////////////////////////////////////////////////
+inline bool LuaScheduler::epollArm(Op* op) {
+  epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events   = (op->kind == Op::WRITE ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+  ev.data.ptr = op;
+
+  if (m_registered.count(op->fd)) {
+    if (epoll_ctl(m_epfd, EPOLL_CTL_MOD, op->fd, &ev) == 0)
+      return true;
+    m_registered.erase(op->fd); // closed behind our back
+  }
+  if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, op->fd, &ev) != 0)
+    return false;
+  m_registered.insert(op->fd);
+  return true;
+}
+
+// epollWait: performs operations whose descriptors became ready, rearming
+// the ones that still would block
+////////////////////////////////////////////////////////////////////////////////
+inline void LuaScheduler::epollWait(bool wait) {
+  epoll_event events[64];
+  int n = epoll_wait(m_epfd, events, 64, wait ? -1 : 0);
+  for (int i = 0; i < n; i++) {
+    Op* op  = (Op*)events[i].data.ptr;
+    int res = tryNow(op);
+    if (res == -EAGAIN && epollArm(op))
+      continue;
+    complete(op, res);
+  }
+}
+
+#endif // LUAWRAPPER_ASYNC_HPP header guard
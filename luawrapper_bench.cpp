@@ -0,0 +1,407 @@
+/*******************************************************************************
+  url/git: http://fpaboim.github.com/luawrapper
+  Distributed under the MIT License.
+
+  Microbenchmarks for the LuaWrapper primitives. Each benchmark reports the
+  best ns/op over several runs and the results are written as JSON. Given a
+  baseline JSON from an earlier run, the program fails when any primitive is
+  slower than the baseline by more than the threshold percentage or when a
+  baseline entry is no longer measured.
+
+  Build against lua, e.g.:
+    g++ -O2 -std=c++11 luawrapper_bench.cpp -llua -o luawrapper_bench
+  Usage:
+    luawrapper_bench [--json out.json] [--baseline base.json]
+                     [--threshold percent] [--iterations n]
+*******************************************************************************/
+#include <chrono>
+#include <string>
+#include <vector>
+#include "luawrapper.hpp"
+
+LuaWrapper* LuaWrapper::m_LuaWrapper = NULL;
+
+// the benchmarks do not need the application commands
+int luaopen_commands(lua_State*) { return 0; }
+
+typedef std::chrono::steady_clock benchClock;
+
+struct BenchResult {
+  std::string name;
+  double      nsPerOp;
+};
+
+// runs of each benchmark, the fastest one is reported
+static const int RUNS = 5;
+
+// nsSince: nanoseconds elapsed since start
+////////////////////////////////////////////////////////////////////////////////
+static double nsSince(benchClock::time_point start) {
+  return std::chrono::duration<double, std::nano>(
+    benchClock::now() - start).count();
+}
+
+// measure: runs body(n) RUNS times and returns the best time per operation
+////////////////////////////////////////////////////////////////////////////////
+template <class Body>
+static double measure(long n, Body body) {
+  double best = 0;
+  for (int run = 0; run < RUNS; run++) {
+    benchClock::time_point start = benchClock::now();
+    body(n);
+    double ns = nsSince(start) / (double)n;
+    if (run == 0 || ns < best)
+      best = ns;
+  }
+  return best;
+}
+
+// runBenchmarks: measures every primitive, n is the iteration count
+////////////////////////////////////////////////////////////////////////////////
+static std::vector<BenchResult> runBenchmarks(long n) {
+  LuaWrapper lw;
+  lua_State* L = lw.getLuaState();
+  std::vector<BenchResult> results;
+  BenchResult r;
+  volatile double sink = 0;
+
+  r.name = "pushNumber/popNumber";
+  r.nsPerOp = measure(n, [&](long iters) {
+    for (long i = 0; i < iters; i++) {
+      lw.pushNumber((double)i);
+      sink = sink + lw.popNumber();
+    }
+  });
+  results.push_back(r);
+
+  r.name = "pushString/popString";
+  r.nsPerOp = measure(n, [&](long iters) {
+    for (long i = 0; i < iters; i++) {
+      lw.pushString("benchmark string");
+      sink = sink + (double)lw.popString()[0];
+    }
+  });
+  results.push_back(r);
+
+  lw.createTable();
+  for (int i = 1; i <= 64; i++) {
+    lw.pushInt(i);
+    lw.pushNumber(i);
+    lw.setTable();
+  }
+  lw.pushString("field");
+  lw.pushNumber(1.0);
+  lw.setTable();
+
+  char field[] = "field";
+  r.name = "pushTableValue(key)";
+  r.nsPerOp = measure(n, [&](long iters) {
+    for (long i = 0; i < iters; i++) {
+      lw.pushTableValue(field);
+      sink = sink + lw.popNumber();
+    }
+  });
+  results.push_back(r);
+
+  r.name = "pushTableValue(index)";
+  r.nsPerOp = measure(n, [&](long iters) {
+    for (long i = 0; i < iters; i++) {
+      lw.pushTableValue((int)(i & 63) + 1);
+      sink = sink + lw.popNumber();
+    }
+  });
+  results.push_back(r);
+
+  r.name = "setTable";
+  r.nsPerOp = measure(n, [&](long iters) {
+    for (long i = 0; i < iters; i++) {
+      lw.pushInt((int)(i & 63) + 1);
+      lw.pushNumber((double)i);
+      lw.setTable();
+    }
+  });
+  results.push_back(r);
+  lua_pop(L, 1);
+
+  // the element-wise loop against the bulk transfer of a 1M element array
+  std::vector<double> values(1000000), out(1000000);
+  for (size_t i = 0; i < values.size(); i++)
+    values[i] = (double)i * 0.5;
+  long arrays = n / (long)values.size() + 1;
+
+  r.name = "setTable loop per element";
+  r.nsPerOp = measure(arrays, [&](long iters) {
+    for (long k = 0; k < iters; k++) {
+      lw.createTable();
+      for (size_t i = 0; i < values.size(); i++) {
+        lw.pushInt((int)i + 1);
+        lw.pushNumber(values[i]);
+        lw.setTable();
+      }
+      lua_pop(L, 1);
+    }
+  }) / (double)values.size();
+  results.push_back(r);
+
+  r.name = "pushArray per element";
+  r.nsPerOp = measure(arrays, [&](long iters) {
+    for (long k = 0; k < iters; k++) {
+      lw.pushArray(values);
+      lua_pop(L, 1);
+    }
+  }) / (double)values.size();
+  results.push_back(r);
+
+  lw.pushArray(values);
+  r.name = "readArray per element";
+  r.nsPerOp = measure(arrays, [&](long iters) {
+    for (long k = 0; k < iters; k++)
+      lw.readArray(-1, out);
+  }) / (double)values.size();
+  results.push_back(r);
+  lua_pop(L, 1);
+
+  luaL_dostring(L, "function benchAdd(a, b) return a + b end");
+  char fname[] = "benchAdd";
+  r.name = "getGlobal+callFunction";
+  r.nsPerOp = measure(n, [&](long iters) {
+    for (long i = 0; i < iters; i++) {
+      lw.getGlobal(fname);
+      lw.pushNumber(1.0);
+      lw.pushNumber((double)i);
+      lw.callFunction(2, 1);
+      sink = sink + lw.popNumber();
+    }
+  });
+  results.push_back(r);
+
+  lw.enableCallStats(true);
+  r.name = "getGlobal+callFunction with call stats";
+  r.nsPerOp = measure(n, [&](long iters) {
+    for (long i = 0; i < iters; i++) {
+      lw.getGlobal(fname);
+      lw.pushNumber(1.0);
+      lw.pushNumber((double)i);
+      lw.callFunction(2, 1);
+      sink = sink + lw.popNumber();
+    }
+  });
+  results.push_back(r);
+  lw.enableCallStats(false);
+
+  LuaFunction add = lw.getFunction(fname);
+  r.name = "LuaFunction::call";
+  r.nsPerOp = measure(n, [&](long iters) {
+    for (long i = 0; i < iters; i++)
+      sink = sink + add.call<double>(1.0, (double)i);
+  });
+  results.push_back(r);
+  add.release();
+
+  r.name = "pop2Ref/pushRef";
+  r.nsPerOp = measure(n, [&](long iters) {
+    for (long i = 0; i < iters; i++) {
+      lw.pushNumber((double)i);
+      lw.pushRef(lw.pop2Ref());
+      sink = sink + lw.popNumber();
+    }
+  });
+  results.push_back(r);
+
+  lw.createTable();
+  LuaRef ref = lw.pop2LuaRef();
+  r.name = "LuaRef::push";
+  r.nsPerOp = measure(n, [&](long iters) {
+    for (long i = 0; i < iters; i++) {
+      ref.push();
+      lua_pop(L, 1);
+    }
+  });
+  results.push_back(r);
+  ref.release();
+
+  const char* script = "luawrapper_bench_tmp.lua";
+  FILE* fp = fopen(script, "w");
+  if (fp) {
+    fputs("local t = {}\nfor i = 1, 16 do t[i] = i * 2 end\nreturn t\n", fp);
+    fclose(fp);
+    long files = n / 100 + 1;
+
+    r.name = "doFile";
+    r.nsPerOp = measure(files, [&](long iters) {
+      for (long i = 0; i < iters; i++) {
+        lw.doFile(script);
+        lua_settop(L, 0);
+      }
+    });
+    results.push_back(r);
+
+    r.name = "doFileMapped";
+    r.nsPerOp = measure(files, [&](long iters) {
+      for (long i = 0; i < iters; i++) {
+        lw.doFileMapped(script);
+        lua_settop(L, 0);
+      }
+    });
+    results.push_back(r);
+
+    r.name = "doFileCached";
+    r.nsPerOp = measure(files, [&](long iters) {
+      for (long i = 0; i < iters; i++) {
+        lw.doFileCached(script);
+        lua_settop(L, 0);
+      }
+    });
+    results.push_back(r);
+    remove(script);
+  }
+
+  long states = n / 1000 + 1;
+  r.name = "LuaWrapper construction";
+  r.nsPerOp = measure(states, [&](long iters) {
+    for (long i = 0; i < iters; i++)
+      LuaWrapper fresh;
+  });
+  results.push_back(r);
+
+  lw.saveBaseline();
+  r.name = "reset";
+  r.nsPerOp = measure(states, [&](long iters) {
+    for (long i = 0; i < iters; i++) {
+      luaL_dostring(L, "benchLeak = {} benchAdd = nil");
+      lw.reset();
+    }
+  });
+  results.push_back(r);
+
+  return results;
+}
+
+// writeJson: writes results as {"benchmarks": {"name": ns_per_op, ...}}
+////////////////////////////////////////////////////////////////////////////////
+static void writeJson(FILE* fp, const std::vector<BenchResult>& results) {
+  fprintf(fp, "{\n  \"unit\": \"ns/op\",\n  \"benchmarks\": {\n");
+  for (size_t i = 0; i < results.size(); i++) {
+    fprintf(fp, "    \"%s\": %.3f%s\n", results[i].name.c_str(),
+            results[i].nsPerOp, i + 1 < results.size() ? "," : "");
+  }
+  fprintf(fp, "  }\n}\n");
+}
+
+// readBaseline: reads "name": number pairs of a JSON file written by writeJson
+////////////////////////////////////////////////////////////////////////////////
+static bool readBaseline(const char* filename,
+                         std::vector<BenchResult>& baseline) {
+  FILE* fp = fopen(filename, "rb");
+  if (!fp)
+    return false;
+  std::string text;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    text.append(buf, n);
+  fclose(fp);
+
+  size_t pos = text.find("\"benchmarks\"");
+  if (pos == std::string::npos)
+    return false;
+  pos = text.find('{', pos);
+  while (pos != std::string::npos) {
+    size_t open = text.find('"', pos);
+    if (open == std::string::npos)
+      break;
+    size_t close = text.find('"', open + 1);
+    size_t colon = text.find(':', close);
+    if (close == std::string::npos || colon == std::string::npos)
+      break;
+    BenchResult r;
+    r.name    = text.substr(open + 1, close - open - 1);
+    r.nsPerOp = strtod(text.c_str() + colon + 1, NULL);
+    baseline.push_back(r);
+    pos = colon + 1;
+  }
+  return true;
+}
+
+// compare: reports primitives slower than baseline by more than threshold
+// percent and baseline entries no longer measured, returns the number of
+// regressions
+////////////////////////////////////////////////////////////////////////////////
+static int compare(const std::vector<BenchResult>& results,
+                   const std::vector<BenchResult>& baseline,
+                   double threshold) {
+  int regressions = 0;
+  for (size_t j = 0; j < baseline.size(); j++) {
+    size_t i = 0;
+    while (i < results.size() && results[i].name != baseline[j].name)
+      i++;
+    if (i == results.size()) {
+      fprintf(stderr, "%-28s missing from this run  MISSING\n",
+              baseline[j].name.c_str());
+      regressions++;
+      continue;
+    }
+    if (baseline[j].nsPerOp <= 0)
+      continue;
+    double change = (results[i].nsPerOp / baseline[j].nsPerOp - 1.0) * 100.0;
+    bool regressed = change > threshold;
+    fprintf(stderr, "%-28s %10.2f ns/op  baseline %10.2f  %+7.1f%%%s\n",
+            results[i].name.c_str(), results[i].nsPerOp,
+            baseline[j].nsPerOp, change, regressed ? "  REGRESSION" : "");
+    if (regressed)
+      regressions++;
+  }
+  return regressions;
+}
+
+int main(int argc, char** argv) {
+  const char* json      = NULL;
+  const char* baseline  = NULL;
+  double      threshold = 10.0;
+  long        n         = 1000000;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--json") && i + 1 < argc) {
+      json = argv[++i];
+    } else if (!strcmp(argv[i], "--baseline") && i + 1 < argc) {
+      baseline = argv[++i];
+    } else if (!strcmp(argv[i], "--threshold") && i + 1 < argc) {
+      threshold = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--iterations") && i + 1 < argc) {
+      n = atol(argv[++i]);
+    } else {
+      fprintf(stderr, "usage: %s [--json out.json] [--baseline base.json] "
+                      "[--threshold percent] [--iterations n]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (n < 1)
+    n = 1;
+
+  std::vector<BenchResult> results = runBenchmarks(n);
+
+  FILE* fp = json ? fopen(json, "w") : stdout;
+  if (!fp) {
+    fprintf(stderr, "cannot write %s\n", json);
+    return 2;
+  }
+  writeJson(fp, results);
+  if (json)
+    fclose(fp);
+
+  if (baseline) {
+    std::vector<BenchResult> base;
+    if (!readBaseline(baseline, base)) {
+      fprintf(stderr, "cannot read baseline %s\n", baseline);
+      return 2;
+    }
+    int regressions = compare(results, base, threshold);
+    if (regressions) {
+      fprintf(stderr, "%d primitive(s) regressed more than %.1f%% or are "
+                      "missing\n",
+              regressions, threshold);
+      return 1;
+    }
+  }
+  return 0;
+}